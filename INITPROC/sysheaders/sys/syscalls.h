@@ -9,8 +9,14 @@
 #define num_sys_close     3
 #define num_sys_stat      5
 #define num_sys_lseek     8
+#define num_sys_mmap      9
+#define num_sys_mprotect  10
+#define num_sys_munmap    11
 #define num_sys_pread     17
 #define num_sys_pwrite    18
+#define num_sys_madvise   28
+#define num_sys_dup       32
+#define num_sys_dup2      33
 #define num_sys_sync      74
 #define num_sys_datasync  75
 #define num_sys_truncate  77
@@ -26,6 +32,24 @@
 #define num_sys_chmod     90
 #define num_sys_chown     92
 
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_POPULATE    0x8000
+#define MAP_FAILED      ((void*)-1)
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
 typedef unsigned int   mode_t;
 typedef unsigned int   uid_t;
 typedef unsigned int   gid_t;
@@ -123,6 +147,14 @@ static inline int sys_close(int fd) {
     return syscall1(num_sys_close, fd);
 }
 
+static inline int sys_dup(int fd) {
+    return syscall1(num_sys_dup, fd);
+}
+
+static inline int sys_dup2(int oldfd, int newfd) {
+    return syscall2(num_sys_dup2, oldfd, newfd);
+}
+
 static inline ssize_t sys_read(int fd, void* buf, size_t count) {
     return syscall3(num_sys_read, fd, (long)buf, count);
 }
@@ -203,4 +235,20 @@ static inline int sys_getdents(int fd, void* buf, size_t bufsize) {
     return syscall3(num_sys_getdents, fd, (long)buf, bufsize);
 }
 
+static inline void* sys_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    return (void*)syscall6(num_sys_mmap, (long)addr, len, prot, flags, fd, offset);
+}
+
+static inline int sys_munmap(void* addr, size_t len) {
+    return syscall2(num_sys_munmap, (long)addr, len);
+}
+
+static inline int sys_mprotect(void* addr, size_t len, int prot) {
+    return syscall3(num_sys_mprotect, (long)addr, len, prot);
+}
+
+static inline int sys_madvise(void* addr, size_t len, int advice) {
+    return syscall3(num_sys_madvise, (long)addr, len, advice);
+}
+
 #endif
@@ -24,6 +24,34 @@ namespace x86_64 {
 		void io_wait();
 	}
 namespace cpu {
+	// APs are not started yet, everything runs on the BSP
+	static inline uint32_t current_id() { return 0; }
+
+	static inline uint64_t rdtsc() {
+		uint32_t lo, hi;
+		asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+		return ((uint64_t)hi << 32) | lo;
+	}
+
+	struct cpu_features {
+		bool erms;	// fast rep movsb/stosb
+		bool fsrm;	// fast rep movsb for short copies
+		bool xsave;
+		bool avx2;	// only set once XCR0 enables the AVX state
+	};
+	extern cpu_features features;
+
+	// Does background work, then halts until the next interrupt. The halt is
+	// skipped if `ready` already holds, with no window for an IRQ to slip in
+	// between the check and the halt. Call with interrupts enabled.
+	void idle(bool (*ready)());
+
+	namespace fpu {
+		void initialise();
+		bool kernel_fpu_begin();
+		void kernel_fpu_end();
+	}
+
 	namespace gdt {
 		void load_tss();
 		void load_gdt();
@@ -24,20 +24,23 @@ uacpi_status uacpi_kernel_get_rsdp(uacpi_phys_addr *out_rsdp_address) {
     return UACPI_STATUS_OK;
 }
 
+// Tables in RAM are already in the direct map, anything else (MMIO
+// operation regions) gets mapped uncached next to it. A range is only used
+// in place if every page of it is in the direct map.
 void* uacpi_kernel_map(uacpi_phys_addr addr, uacpi_size len) {
-    void* _addr = (void*)((uint64_t)addr & ~(0xFFF));
-    uint64_t pages = (len + 0xFFF) / 0x1000;
+    uint64_t va = mem::vmm::pa_to_va(addr);
+    uint64_t last = va + (len ? len - 1 : 0);
 
-    mem::vmm::mmap(_addr, _addr, pages, PAGE_PRESENT | PAGE_RW);
-
-    return (void*)addr;
+    for (uint64_t page = va & ~0xFFFULL; page <= last; page += 0x1000) {
+        if (!mem::vmm::translate((void*)page)) return mem::vmm::ioremap(addr, len, mem::vmm::CACHE_UC);
+    }
+    return (void*)va;
 }
 
+// Direct map entries are left in place, a later map of the range reuses them
 void uacpi_kernel_unmap(void *addr, uacpi_size len) {
-    void* _addr = (void*)((uint64_t)addr & ~(0xFFF));
-    uint64_t pages = (len + 0xFFF) / 0x1000;
-
-    mem::vmm::munmap(_addr, pages);
+    (void)addr;
+    (void)len;
 }
 
 #include <config.hpp>
@@ -0,0 +1,87 @@
+#include <arch/arch.hpp>
+#include <config.hpp>
+
+#define CR0_MP          (1 << 1)
+#define CR0_EM          (1 << 2)
+#define CR0_TS          (1 << 3)
+#define CR4_OSFXSR      (1 << 9)
+#define CR4_OSXMMEXCPT  (1 << 10)
+#define CR4_OSXSAVE     (1 << 18)
+
+#define XCR0_X87        0x1
+#define XCR0_SSE        0x2
+#define XCR0_AVX        0x4
+
+// Legacy area + header + AVX state is 832 bytes
+#define XSAVE_AREA_SIZE 1024
+
+namespace arch::x86_64::cpu {
+
+cpu_features features;
+
+}
+
+namespace arch::x86_64::cpu::fpu {
+
+struct fpu_save {
+    alignas(64) uint8_t area[XSAVE_AREA_SIZE];
+    volatile bool in_use;
+};
+
+static fpu_save saves[CONFIG_MAX_CPUS];
+static uint64_t xcr0 = 0;
+
+void initialise() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    bool xsave = ecx & (1 << 26);
+    bool avx = ecx & (1 << 28);
+
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    features.erms = ebx & (1 << 9);
+    features.fsrm = edx & (1 << 4);
+    bool avx2 = ebx & (1 << 5);
+
+    uint64_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(uint64_t)(CR0_EM | CR0_TS)) | CR0_MP;
+    asm volatile("mov %0, %%cr0" :: "r"(cr0));
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (xsave) cr4 |= CR4_OSXSAVE;
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+    asm volatile("fninit");
+
+    if (!xsave) return;
+
+    xcr0 = XCR0_X87 | XCR0_SSE | (avx ? XCR0_AVX : 0);
+    asm volatile("xsetbv" :: "c"(0), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)));
+
+    // EBX is the save area size for the features now enabled in XCR0
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(0));
+    if (ebx > XSAVE_AREA_SIZE) return;
+
+    features.xsave = true;
+    features.avx2 = avx && avx2;
+}
+
+// Saves the live FPU/SIMD state, which may belong to user space, so the
+// kernel can use vector registers until kernel_fpu_end. Returns false if
+// the state is already claimed on this CPU (e.g. an interrupt hit a copy),
+// callers then fall back to integer code.
+bool kernel_fpu_begin() {
+    fpu_save* save = &saves[current_id()];
+    if (!features.xsave || save->in_use) return false;
+    save->in_use = true;
+    asm volatile("xsave64 %0" : "=m"(save->area) : "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    return true;
+}
+
+void kernel_fpu_end() {
+    fpu_save* save = &saves[current_id()];
+    asm volatile("xrstor64 %0" :: "m"(save->area), "a"((uint32_t)xcr0), "d"((uint32_t)(xcr0 >> 32)) : "memory");
+    save->in_use = false;
+}
+
+}
@@ -0,0 +1,19 @@
+#include <arch/arch.hpp>
+#include <mem/pmm.hpp>
+
+namespace arch::x86_64::cpu {
+
+void idle(bool (*ready)()) {
+	mem::pmm::zero_pool_refill();
+
+	asm volatile ("cli" ::: "memory");
+	if (ready && ready()) {
+		asm volatile ("sti" ::: "memory");
+		return;
+	}
+	// sti only takes effect after the next instruction, so a pending IRQ
+	// wakes the hlt instead of being taken before it
+	asm volatile ("sti; hlt" ::: "memory");
+}
+
+}
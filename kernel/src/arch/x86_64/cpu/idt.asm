@@ -9,30 +9,66 @@ idt_load:
     lidt [rdi]
     ret
 
+; Stack after the stubs: vector, error code (0 if the CPU pushed none),
+; then the CPU frame starting with RIP. Saving every GPR lets a handled
+; fault (e.g. demand paging) return to the faulting instruction.
 %macro idt_exception_noerr 1
 global idt_exception_noerr_%1
 idt_exception_noerr_%1:
-    mov rdi, rsp
-    mov rsi, %1
-    xor rdx, rdx
-    mov r8, cr2
-    mov r9, cr3
-    call exception_handler
-    iretq
+    push 0
+    push %1
+    jmp exception_common
 %endmacro
 
 %macro idt_exception_err 1
 global idt_exception_err_%1
 idt_exception_err_%1:
-    mov rdi, rsp
-    mov rsi, %1
-    mov rdx, [rsp + 24]
-    mov r8, cr2
-    mov r9, cr3
+    push %1
+    jmp exception_common
+%endmacro
+
+exception_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov rdi, [rsp + 17 * 8] ; rip
+    mov rsi, [rsp + 15 * 8] ; vector
+    mov rdx, [rsp + 16 * 8] ; error code
+    mov rcx, cr2
+    mov r8, cr3
+    cld
     call exception_handler
-    add rsp, 8
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+    add rsp, 16
     iretq
-%endmacro
 
 idt_exception_noerr 0
 idt_exception_noerr 1
@@ -2,6 +2,7 @@
 #include <arch/x86_64/cpu/idt.hpp>
 #include <cstdio>
 #include <mem/mem.hpp>
+#include <mem/vma.hpp>
 
 bool idt_set_vectors[256] = {false};
 
@@ -47,36 +48,9 @@ void fix_exceptions(
 			break;
 		}
 		case 14: {
-			Log::infof("Page Fault Exception handled");
-			printf("Page Fault at CR2: 0x%llX\n", cr2);
-			printf("Error Code: %d\n", error_code);
-
-			if (cr2 & ~0xFFF == 0) {
-				Log::errf("Null pointer dereference detected");
-				asm volatile ("cli;hlt;");
-			}
-
-			if (cr2 < 0x00007FFFFFFFFFFF) {
-				Log::errf("Invalid user space address access detected");
-				asm volatile ("cli;hlt;");
-			}
-
-			if (error_code & 0x1) {
-				Log::infof("Page fault caused by protection violation");
-				asm volatile ("cli;hlt;");
-			} else {
-				Log::infof("Page fault caused by non-present page");
-				mem::vmm::mmap(
-					(void*)(cr2 & ~0xFFF),
-					(void*)(cr2 & ~0xFFF),
-					1,
-					PAGE_PRESENT |
-					PAGE_RW |
-					PAGE_USER
-				);
-				Log::infof("Mapped page for address 0x%llX", cr2);
-			}
-
+			// Faults a VMA can back never get here, see exception_handler
+			Log::errf("Unhandled page fault at 0x%llX (error 0x%llX)", cr2, error_code);
+			asm volatile ("cli;hlt;");
 			break;
 		}
 		default:
@@ -92,6 +66,8 @@ extern "C" void exception_handler(
 	uint64_t cr2,
 	uint64_t cr3
 ) {
+	if (exception_vector == 14 && mem::vma::handle_fault(cr2, error_code)) return;
+
 	Log::errf(
 		"EXCEPTION OCCURED!\n\r"
 		"EXCEPTION_TYPE= %s\n\r"
@@ -22,14 +22,19 @@ syscall_func:
     push r9
     push rbp
 
+    ; syscall_handler(rax, rdi, rsi, rdx, r10, r8, r9), the user's r9 goes
+    ; on the stack and rcx still holds the return rip until it is loaded
     mov rdi, [rsp+56]
     mov rsi, [rsp+48]
     mov rdx, [rsp+40]
-    mov r10, [rsp+32]
+    mov rcx, [rsp+32]
     mov r8, [rsp+24]
     mov r9, [rsp+16]
+    sub rsp, 8
+    push qword [rsp+16]
 
     call syscall_handler
+    add rsp, 16
 
     pop rbp
     pop r9
@@ -38,7 +43,7 @@ syscall_func:
     pop rdx
     pop rsi
     pop rdi
-    pop rax
+    add rsp, 8      ; rax carries the return value
 
     pop r11
     pop rcx
@@ -1,17 +1,8 @@
 #include "syscall.hpp"
-#include <cstdio>
+#include "trace.hpp"
+#include <config.hpp>
 #include "syscalls/handlers.hpp"
 
-syscall_entry syscalls[512];
-int num_syscalls = 0;
-
-void add_syscall(int num, uint64_t* handler) {
-	if (num_syscalls >= 512) return;
-	syscalls[num_syscalls].num = num;
-	syscalls[num_syscalls].func = handler;
-	num_syscalls++;
-}
-
 static inline uint64_t rdmsr(uint32_t msr) {
     uint32_t lo, hi;
     asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr) : "memory");
@@ -31,23 +22,97 @@ static inline void wrmsr(uint32_t msr, uint64_t value) {
 
 extern uint64_t _tss_rsp, _tss_rbp;
 
-extern "C" void syscall_func();
-extern "C" uint64_t syscall_handler(uint64_t rax, uint64_t rdi, uint64_t rsi,
-						 uint64_t rdx, uint64_t r10, uint64_t r8, uint64_t r9) {
-	for (int i = 0; i < num_syscalls; i++) {
-		if (syscalls[i].num == rax) {
-			printf("SYSCALL!\n\rRAX= 0x%llX\n\rRDI= 0x%llX\n\rRSI= 0x%llX\n\rRDX= 0x%llX\n\rR10= 0x%llX\n\r",
-				rdi, rsi, rdx, r10
-			);
-			uint64_t (*handler)(uint64_t,uint64_t,uint64_t,uint64_t) = (uint64_t(*)(uint64_t,uint64_t,uint64_t,uint64_t))syscalls[i].func;
-			return handler(rdi, rsi, rdx, r10);
-		}
+typedef uint64_t (*syscall_fn)(const uint64_t* args);
+
+// Hands the raw argument registers to a handler, each one converted to its
+// parameter type in order
+template <typename... A>
+struct unpack;
+
+template <>
+struct unpack<> {
+	template <typename F, typename... V>
+	static uint64_t call(F f, const uint64_t*, V... v) { return f(v...); }
+};
+
+template <typename H, typename... T>
+struct unpack<H, T...> {
+	template <typename F, typename... V>
+	static uint64_t call(F f, const uint64_t* a, V... v) {
+		return unpack<T...>::call(f, a + 1, v..., (H)*a);
 	}
-	return (uint64_t)-1;
+};
+
+template <auto F>
+struct thunk;
+
+template <typename... A, uint64_t (*F)(A...)>
+struct thunk<F> {
+	static_assert(sizeof...(A) <= 6, "syscalls take at most six arguments");
+	static uint64_t call(const uint64_t* args) { return unpack<A...>::call(F, args); }
+};
+
+struct syscall_table {
+	syscall_fn fn[SYSCALL_MAX];
+};
+
+// Not constexpr, so a number registered twice fails the build
+void duplicate_syscall();
+
+static constexpr void set(syscall_table& t, uint64_t nr, syscall_fn fn) {
+	if (t.fn[nr]) duplicate_syscall();
+	t.fn[nr] = fn;
+}
+
+#define SYSCALL(nr, handler) set(t, nr, thunk<handler>::call)
+
+static constexpr syscall_table build_table() {
+	syscall_table t = {};
+	SYSCALL(0, sys_read);
+	SYSCALL(1, sys_write);
+	SYSCALL(2, sys_open);
+	SYSCALL(3, sys_close);
+	SYSCALL(5, sys_stat);
+	SYSCALL(8, sys_lseek);
+	SYSCALL(9, sys_mmap);
+	SYSCALL(10, sys_mprotect);
+	SYSCALL(11, sys_munmap);
+	SYSCALL(17, sys_pread);
+	SYSCALL(18, sys_pwrite);
+	SYSCALL(28, sys_madvise);
+	SYSCALL(32, sys_dup);
+	SYSCALL(33, sys_dup2);
+	SYSCALL(74, sys_sync);
+	SYSCALL(75, sys_datasync);
+	SYSCALL(77, sys_truncate);
+	SYSCALL(78, sys_getdents);
+	SYSCALL(80, sys_chdir);
+	SYSCALL(82, sys_rename);
+	SYSCALL(83, sys_mkdir);
+	SYSCALL(84, sys_rmdir);
+	SYSCALL(86, sys_link);
+	SYSCALL(87, sys_unlink);
+	SYSCALL(88, sys_symlink);
+	SYSCALL(89, sys_readlink);
+	SYSCALL(90, sys_chmod);
+	SYSCALL(92, sys_chown);
+	return t;
 }
 
+static constexpr syscall_table table = build_table();
 
-#define HANDLER(handler) ((uint64_t*)handler)
+extern "C" void syscall_func();
+extern "C" uint64_t syscall_handler(uint64_t rax, uint64_t rdi, uint64_t rsi,
+						 uint64_t rdx, uint64_t r10, uint64_t r8, uint64_t r9) {
+	const uint64_t args[6] = { rdi, rsi, rdx, r10, r8, r9 };
+	syscall_fn fn = rax < SYSCALL_MAX ? table.fn[rax] : nullptr;
+	uint64_t ret = fn ? fn(args) : (uint64_t)-1;
+
+#ifdef CONFIG_SYSCALL_TRACE
+	arch::x86_64::syscall::trace::record(rax, args, ret);
+#endif
+	return ret;
+}
 
 namespace arch::x86_64::syscall {
 
@@ -64,28 +129,9 @@ void initialise() {
 	wrmsr(IA32_LSTAR, (uint64_t)&syscall_func);
 	wrmsr(IA32_FMASK, 0);
 
-	add_syscall(2, HANDLER(sys_open));
-	add_syscall(3, HANDLER(sys_close));
-	add_syscall(0, HANDLER(sys_read));
-	add_syscall(1, HANDLER(sys_write));
-	add_syscall(17, HANDLER(sys_pread));
-	add_syscall(18, HANDLER(sys_pwrite));
-	add_syscall(8, HANDLER(sys_lseek));
-	add_syscall(5, HANDLER(sys_stat));
-	add_syscall(90, HANDLER(sys_chmod));
-	add_syscall(92, HANDLER(sys_chown));
-	add_syscall(77, HANDLER(sys_truncate));
-	add_syscall(74, HANDLER(sys_sync));
-	add_syscall(75, HANDLER(sys_datasync));
-	add_syscall(83, HANDLER(sys_mkdir));
-	add_syscall(80, HANDLER(sys_chdir));
-	add_syscall(86, HANDLER(sys_link));
-	add_syscall(87, HANDLER(sys_unlink));
-	add_syscall(82, HANDLER(sys_rename));
-	add_syscall(88, HANDLER(sys_symlink));
-	add_syscall(89, HANDLER(sys_readlink));
-	add_syscall(84, HANDLER(sys_rmdir));
-	add_syscall(78, HANDLER(sys_getdents));
+#ifdef CONFIG_SYSCALL_TRACE
+	trace::initialise();
+#endif
 }
 
 }
@@ -5,10 +5,8 @@
 #include <types.hpp>
 #include <cstdint>
 
-struct syscall_entry {
-    int num;
-    uint64_t* func;
-};
+// Numbers follow the Linux x86_64 ABI, anything at or above this is -1
+#define SYSCALL_MAX 512
 
 namespace arch::x86_64::syscall {
 
@@ -6,6 +6,8 @@
 
 uint64_t sys_open(const char* path, int flags, mode_t mode);
 uint64_t sys_close(int fd);
+uint64_t sys_dup(int fd);
+uint64_t sys_dup2(int oldfd, int newfd);
 uint64_t sys_read(int fd, void* buf, size_t count);
 uint64_t sys_write(int fd, const void* buf, size_t count);
 uint64_t sys_pread(int fd, void* buf, size_t count, off_t offset);
@@ -26,5 +28,9 @@ uint64_t sys_symlink(const char* target, const char* linkpath);
 uint64_t sys_readlink(const char* path, char* buf, size_t bufsize);
 uint64_t sys_rmdir(const char* path);
 uint64_t sys_getdents(int fd, void* buf, size_t bufsize);
+uint64_t sys_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset);
+uint64_t sys_munmap(void* addr, size_t len);
+uint64_t sys_mprotect(void* addr, size_t len, int prot);
+uint64_t sys_madvise(void* addr, size_t len, int advice);
 
 #endif
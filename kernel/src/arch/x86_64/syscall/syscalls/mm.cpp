@@ -0,0 +1,120 @@
+#include "../syscall.hpp"
+#include <vfs/vfs.hpp>
+#include <mem/vma.hpp>
+#include <errno.hpp>
+
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_POPULATE 0x8000
+
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
+
+#define MAP_FAILED ((uint64_t)-1)
+
+static constexpr uint64_t PAGE_SIZE = 0x1000;
+
+// User ranges must be page aligned and end at or below the stack top
+static bool user_range(uint64_t addr, size_t len) {
+    return !(addr & (PAGE_SIZE - 1)) && len && len <= USER_STACK_TOP && addr <= USER_STACK_TOP - len;
+}
+
+static uint32_t vma_prot(int prot) {
+    uint32_t v = VMA_USER;
+    if (prot & PROT_READ) v |= VMA_READ;
+    if (prot & PROT_WRITE) v |= VMA_WRITE;
+    if (prot & PROT_EXEC) v |= VMA_EXEC;
+    return v;
+}
+
+uint64_t sys_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    mem::vma::mm* m = mem::vma::current();
+    int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (!m || !len || (type != MAP_SHARED && type != MAP_PRIVATE)) return MAP_FAILED;
+    if (len > USER_STACK_TOP) return MAP_FAILED;
+
+    uint32_t vprot = vma_prot(prot);
+    if (type == MAP_SHARED) vprot |= VMA_SHARED;
+
+    vfs::vnode* node = nullptr;
+    if (!(flags & MAP_ANONYMOUS)) {
+        vfs::file* f = vfs::get_file(fd);
+        if (!f || offset < 0 || (offset & (PAGE_SIZE - 1))) return MAP_FAILED;
+        node = f->node;
+        if (!node->ops->readpage) return MAP_FAILED;
+
+        int access = f->flags & (O_WRONLY | O_RDWR);
+        if (access == O_WRONLY) return MAP_FAILED;
+        // Stores through the mapping would never reach the backing store
+        bool may_write = access == O_RDWR && !node->ops->writepage;
+        if (type == MAP_SHARED && (prot & PROT_WRITE) && !may_write) return MAP_FAILED;
+        if (type == MAP_SHARED && may_write) vprot |= VMA_MAYWRITE;
+    }
+
+    uint64_t start = (uint64_t)addr;
+    if (flags & MAP_FIXED) {
+        if (!user_range(start, len) || mem::vma::unmap_range(m, start, len) < 0) return MAP_FAILED;
+    } else {
+        start = mem::vma::find_free(m, len);
+        if (!start) return MAP_FAILED;
+    }
+
+    mem::vma::vma* v = node ? mem::vma::map_vnode(m, start, len, vprot, node, offset)
+                            : mem::vma::map_anon(m, start, len, vprot, VMA_ANON);
+    if (!v) return MAP_FAILED;
+
+    if (flags & MAP_POPULATE) mem::vma::populate(m, start, len);
+    return start;
+}
+
+uint64_t sys_munmap(void* addr, size_t len) {
+    mem::vma::mm* m = mem::vma::current();
+    if (!m || !user_range((uint64_t)addr, len)) return -1;
+    return mem::vma::unmap_range(m, (uint64_t)addr, len);
+}
+
+uint64_t sys_mprotect(void* addr, size_t len, int prot) {
+    mem::vma::mm* m = mem::vma::current();
+    if (!m || !user_range((uint64_t)addr, len)) return -1;
+
+    // Same rule as mmap, which recorded whether the file was open for
+    // writing and keeps its data in the page cache
+    uint64_t start = (uint64_t)addr;
+    if (prot & PROT_WRITE) {
+        for (uint64_t va = start; va - start < len; va += PAGE_SIZE) {
+            mem::vma::vma* v = mem::vma::find(m, va);
+            if (!v) return -1;
+            if ((v->prot & VMA_SHARED) && v->vnode && !(v->prot & VMA_MAYWRITE)) return -EACCES;
+            va = v->end - PAGE_SIZE;
+        }
+    }
+    return mem::vma::protect(m, start, len, vma_prot(prot));
+}
+
+uint64_t sys_madvise(void* addr, size_t len, int advice) {
+    mem::vma::mm* m = mem::vma::current();
+    if (!m || !user_range((uint64_t)addr, len)) return -1;
+
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+            return 0;
+        case MADV_WILLNEED:
+            return mem::vma::populate(m, (uint64_t)addr, len);
+        case MADV_DONTNEED:
+            return mem::vma::discard(m, (uint64_t)addr, len);
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,64 @@
+#include "trace.hpp"
+#include <arch/arch.hpp>
+#include <devfs/devfs.hpp>
+#include <mem/mem.hpp>
+#include <config.hpp>
+
+#ifdef CONFIG_SYSCALL_TRACE
+
+#define TRACE_ENTRIES CONFIG_SYSCALL_TRACE_ENTRIES
+
+static_assert((TRACE_ENTRIES & (TRACE_ENTRIES - 1)) == 0, "SYSCALL_TRACE_ENTRIES must be a power of two");
+
+// Writers claim a slot and fill it in without a lock, a reader racing with
+// a wrap may see one entry half overwritten
+static arch::x86_64::syscall::trace::entry ring[TRACE_ENTRIES];
+static uint64_t head;
+
+// Offsets count from the oldest entry still in the ring, so the file
+// shifts as new syscalls come in. Read it in one go.
+static ssize_t device_read(void* ctx, void* buf, size_t count, off_t offset) {
+	const size_t size = sizeof(arch::x86_64::syscall::trace::entry);
+	uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	uint64_t first = end > TRACE_ENTRIES ? end - TRACE_ENTRIES : 0;
+	size_t total = (end - first) * size;
+
+	if ((size_t)offset >= total) return 0;
+	if (count > total - offset) count = total - offset;
+
+	char* out = (char*)buf;
+	for (size_t done = 0; done < count;) {
+		uint64_t pos = offset + done;
+		size_t skip = pos % size;
+		size_t chunk = size - skip;
+		if (chunk > count - done) chunk = count - done;
+
+		const char* e = (const char*)&ring[(first + pos / size) & (TRACE_ENTRIES - 1)];
+		mem::memcpy(out + done, e + skip, chunk);
+		done += chunk;
+	}
+	return count;
+}
+
+static const devfs::device_ops trace_ops = { .read = device_read };
+
+namespace arch::x86_64::syscall::trace {
+
+void initialise() {
+	devfs::register_device("systrace", &trace_ops, nullptr, 0444);
+}
+
+void record(uint64_t nr, const uint64_t* args, uint64_t ret) {
+	uint64_t slot = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	entry* e = &ring[slot & (TRACE_ENTRIES - 1)];
+
+	e->tsc = cpu::rdtsc();
+	e->nr = nr;
+	e->cpu = cpu::current_id();
+	for (int i = 0; i < 6; i++) e->args[i] = args[i];
+	e->ret = ret;
+}
+
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SYSCALL_TRACE_HPP
+#define SYSCALL_TRACE_HPP 1
+
+#include <cstdint>
+#include <cstddef>
+
+// Opt-in record of the most recent syscalls, see CONFIG_SYSCALL_TRACE.
+// /dev/systrace reads the ring as raw entries, oldest first.
+namespace arch::x86_64::syscall::trace {
+
+struct entry {
+	uint64_t tsc;
+	uint32_t nr;
+	uint32_t cpu;
+	uint64_t args[6];
+	uint64_t ret;
+};
+
+void initialise();
+void record(uint64_t nr, const uint64_t* args, uint64_t ret);
+
+}
+
+#endif /* SYSCALL_TRACE_HPP */
@@ -0,0 +1,232 @@
+#include "devfs.hpp"
+#include <vfs/vfs.hpp>
+#include <vfs/pagecache.hpp>
+#include <drivers/tty/ldisc/ldisc.hpp>
+#include <cstring>
+#include <mem/mem.hpp>
+#include <cstdio>
+
+namespace devfs {
+
+// vn must stay first, the vnode ops cast back to the node
+struct dev_node {
+    vfs::vnode vn;
+    char name[32];
+    const device_ops* ops;
+    const block_ops* bops;
+    void* ctx;
+    dev_node* next;
+};
+
+struct memory_region {
+    const char* base;
+    size_t size;
+};
+
+extern const vfs::vnode_ops ops;
+extern const vfs::vnode_ops block_vnode_ops;
+
+// One flat directory, there are only a handful of devices
+static vfs::superblock sb;
+static vfs::vnode root;
+static dev_node* devices = nullptr;
+static bool mounted = false;
+
+static inline dev_node* node_of(vfs::vnode* v) {
+    return reinterpret_cast<dev_node*>(v);
+}
+
+static vfs::vnode* lookup(vfs::vnode* dir, const char* name, size_t len) {
+    if ((len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) return dir;
+    for (dev_node* d = devices; d; d = d->next) {
+        if (mem::memcmp(d->name, name, len) == 0 && d->name[len] == '\0') return &d->vn;
+    }
+    return nullptr;
+}
+
+static ssize_t getdents(vfs::vnode* dir, void* buf, size_t bufsize) {
+    char* out = (char*)buf;
+    size_t used = 0;
+    for (dev_node* d = devices; d; d = d->next) {
+        size_t len = strlen(d->name);
+        if (used + len + 1 > bufsize) break;
+        strcpy(out + used, d->name);
+        used += len + 1;
+    }
+    return used;
+}
+
+static ssize_t read(vfs::vnode* v, void* buf, size_t count, off_t offset) {
+    dev_node* d = node_of(v);
+    if (!d->ops->read) return -1;
+    return d->ops->read(d->ctx, buf, count, offset);
+}
+
+static ssize_t write(vfs::vnode* v, const void* buf, size_t count, off_t offset) {
+    dev_node* d = node_of(v);
+    if (!d->ops->write) return -1;
+    return d->ops->write(d->ctx, buf, count, offset);
+}
+
+static constexpr size_t PAGE_SIZE = 0x1000;
+static constexpr size_t SECTORS_PER_PAGE = PAGE_SIZE / DEVFS_SECTOR_SIZE;
+
+// The last page of a device may only be partly backed by sectors
+static size_t page_sectors(dev_node* d, uint64_t index) {
+    uint64_t lba = index * SECTORS_PER_PAGE;
+    uint64_t sectors = d->vn.size / DEVFS_SECTOR_SIZE;
+    if (lba >= sectors) return 0;
+    return sectors - lba < SECTORS_PER_PAGE ? sectors - lba : SECTORS_PER_PAGE;
+}
+
+static int block_readpage(vfs::vnode* v, uint64_t index, void* page) {
+    dev_node* d = node_of(v);
+    size_t count = page_sectors(d, index);
+    if (d->bops->read(d->ctx, index * SECTORS_PER_PAGE, count, page) < 0) return -1;
+    mem::memset((char*)page + count * DEVFS_SECTOR_SIZE, 0, PAGE_SIZE - count * DEVFS_SECTOR_SIZE);
+    return 0;
+}
+
+static int block_writepage(vfs::vnode* v, uint64_t index, const void* page) {
+    dev_node* d = node_of(v);
+    if (!d->bops->write) return -1;
+    return d->bops->write(d->ctx, index * SECTORS_PER_PAGE, page_sectors(d, index), page) < 0 ? -1 : 0;
+}
+
+const vfs::vnode_ops ops = {
+    .lookup = lookup,
+    .getdents = getdents,
+    .read = read,
+    .write = write,
+};
+
+const vfs::vnode_ops block_vnode_ops = {
+    .read = vfs::pagecache::read,
+    .write = vfs::pagecache::write,
+    .readpage = block_readpage,
+    .writepage = block_writepage,
+};
+
+static vfs::superblock* mount(const char* source) {
+    if (mounted) {
+        Log::errf("devfs: Already mounted");
+        return nullptr;
+    }
+    mounted = true;
+    return &sb;
+}
+
+static const vfs::filesystem fs = {
+    .name = "devfs",
+    .mount = mount,
+};
+
+static dev_node* add_device(const char* name, const device_ops* dev_ops, void* ctx, mode_t mode) {
+    size_t len = strlen(name);
+    if (len >= sizeof(dev_node::name) || lookup(&root, name, len)) {
+        Log::errf("devfs: Cannot register %s", name);
+        return nullptr;
+    }
+
+    dev_node* d = (dev_node*)mem::heap::malloc(sizeof(dev_node));
+    if (!d) return nullptr;
+    mem::memset(d, 0, sizeof(dev_node));
+
+    mem::memcpy(d->name, name, len + 1);
+    d->vn.ops = &ops;
+    d->vn.sb = &sb;
+    d->vn.type = vfs::VNODE_CHRDEV;
+    d->vn.mode = mode;
+    d->vn.refcount = 1;
+    d->ops = dev_ops;
+    d->ctx = ctx;
+
+    dev_node** tail = &devices;
+    while (*tail) tail = &(*tail)->next;
+    *tail = d;
+    return d;
+}
+
+int register_device(const char* name, const device_ops* dev_ops, void* ctx, mode_t mode) {
+    return add_device(name, dev_ops, ctx, mode) ? 0 : -1;
+}
+
+int register_block(const char* name, const block_ops* dev_ops, void* ctx, uint64_t sectors) {
+    dev_node* d = add_device(name, nullptr, ctx, 0660);
+    if (!d) return -1;
+    d->vn.ops = &block_vnode_ops;
+    d->vn.type = vfs::VNODE_BLKDEV;
+    d->vn.size = sectors * DEVFS_SECTOR_SIZE;
+    d->bops = dev_ops;
+    return 0;
+}
+
+static ssize_t memory_read(void* ctx, void* buf, size_t count, off_t offset) {
+    memory_region* r = (memory_region*)ctx;
+    if ((size_t)offset >= r->size) return 0;
+    if (count > r->size - offset) count = r->size - offset;
+    mem::memcpy(buf, r->base + offset, count);
+    return count;
+}
+
+static const device_ops memory_ops = { .read = memory_read };
+
+int register_memory(const char* name, const void* base, size_t size) {
+    memory_region* r = (memory_region*)mem::heap::malloc(sizeof(memory_region));
+    if (!r) return -1;
+    r->base = (const char*)base;
+    r->size = size;
+
+    dev_node* d = add_device(name, &memory_ops, r, 0444);
+    if (!d) {
+        mem::heap::free(r);
+        return -1;
+    }
+    d->vn.size = size;
+    return 0;
+}
+
+static ssize_t console_read(void* ctx, void* buf, size_t count, off_t offset) {
+    return drivers::tty::ldisc::read(false, (char*)buf, count);
+}
+
+static ssize_t console_write(void* ctx, const void* buf, size_t count, off_t offset) {
+    drivers::tty::ldisc::write((const char*)buf, count);
+    return count;
+}
+
+static ssize_t null_read(void* ctx, void* buf, size_t count, off_t offset) {
+    return 0;
+}
+
+static ssize_t null_write(void* ctx, const void* buf, size_t count, off_t offset) {
+    return count;
+}
+
+static ssize_t zero_read(void* ctx, void* buf, size_t count, off_t offset) {
+    mem::memset(buf, 0, count);
+    return count;
+}
+
+static const device_ops console_ops = { .read = console_read, .write = console_write };
+static const device_ops null_ops = { .read = null_read, .write = null_write };
+static const device_ops zero_ops = { .read = zero_read, .write = null_write };
+
+void initialise() {
+    root.ops = &ops;
+    root.sb = &sb;
+    root.type = vfs::VNODE_DIR;
+    root.mode = 0755;
+    root.refcount = 1;
+    sb.root = &root;
+
+    vfs::register_filesystem(&fs);
+
+    register_device("stdin", &console_ops, nullptr, 0620);
+    register_device("stdout", &console_ops, nullptr, 0620);
+    register_device("stderr", &console_ops, nullptr, 0620);
+    register_device("null", &null_ops, nullptr);
+    register_device("zero", &zero_ops, nullptr);
+}
+
+}
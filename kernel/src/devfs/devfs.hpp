@@ -0,0 +1,36 @@
+#ifndef DEVFS_HPP
+#define DEVFS_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+#include <types.hpp>
+
+#define DEVFS_SECTOR_SIZE 512
+
+namespace devfs {
+
+// Either entry may be null, the call then fails with -1
+struct device_ops {
+    ssize_t (*read)(void* ctx, void* buf, size_t count, off_t offset);
+    ssize_t (*write)(void* ctx, const void* buf, size_t count, off_t offset);
+};
+
+// Sector transfers of a block device, count sectors starting at lba
+struct block_ops {
+    ssize_t (*read)(void* ctx, uint64_t lba, size_t count, void* buf);
+    ssize_t (*write)(void* ctx, uint64_t lba, size_t count, const void* buf);
+};
+
+// Registers "devfs" with the VFS along with the console, null and zero
+void initialise();
+
+int register_device(const char* name, const device_ops* ops, void* ctx, mode_t mode = 0666);
+// Reads and writes of a block device go through the page cache, each
+// page is transferred as the sectors under it
+int register_block(const char* name, const block_ops* ops, void* ctx, uint64_t sectors);
+// Read only view of a range of kernel memory, e.g. a boot module
+int register_memory(const char* name, const void* base, size_t size);
+
+}
+
+#endif /* DEVFS_HPP */
@@ -3,6 +3,7 @@
 #include <cstdio>
 #include <mem/mem.hpp>
 #include <arch/arch.hpp>
+#include <devfs/devfs.hpp>
 
 namespace ahci {
 
@@ -72,6 +73,8 @@ void setup_port(HBAPort* port) {
 
 bool ATA_MODE = false;
 
+static void register_disks();
+
 void initialise() {
     AHCI = pcie::get_device_class_code(0x01, 0x06, true, 0x01);
     if (!AHCI) {
@@ -80,7 +83,11 @@ void initialise() {
     }
 
     uint32_t bar5 = AHCI->bars[5] & ~0xF;
-    ABAR = (HBAMem*)(uint64_t)bar5;
+    ABAR = (HBAMem*)mem::vmm::ioremap(bar5, sizeof(HBAMem), mem::vmm::CACHE_UC);
+    if (!ABAR) {
+        Log::errf("Failed to map ABAR... Halting");
+        asm volatile ("cli;hlt;");
+    }
 
     printf("ABAR= %p\n\r", ABAR);
     
@@ -94,9 +101,6 @@ void initialise() {
         asm volatile ("cli;hlt;");
     }
 
-    size_t abar_size = sizeof(HBAMem) + (last_implemented * sizeof(HBAPort));
-    mem::vmm::mmap((void*)ABAR, (void*)ABAR, (abar_size + 0xFFF) / 0x1000, PAGE_PRESENT | PAGE_RW | PAGE_PCD);
-
     if (!(ABAR->GlobalHostControl & 0x80000000)) {
         Log::warnf("IDE Emulation mode...");
         ATA_MODE = true;
@@ -108,6 +112,8 @@ void initialise() {
             setup_port(port);
         }
     }
+
+    register_disks();
 }
 
 #define ATA_DATA       0x1F0
@@ -128,8 +134,13 @@ void initialise() {
 
 #define ATA_CMD_READ_PIO_EXT  0x24
 #define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_IDENTIFY      0xEC
 #define ATA_SR_BSY  0x80
 #define ATA_SR_DRQ  0x08
+#define ATA_SR_ERR  0x01
+
+// Status polls before IDENTIFY gives up, each inb takes about a microsecond
+#define ATA_IDENTIFY_POLLS 1000000
 
 ssize_t ata_transfer(int port_id, uint64_t lba, size_t sector_count, void* buffer, bool is_write_op) {
     uint8_t device = 0x40;
@@ -182,6 +193,43 @@ ssize_t ata_transfer(int port_id, uint64_t lba, size_t sector_count, void* buffe
     return sector_count * 512;
 }
 
+// Sector count of the master drive on the primary channel, 0 without one
+static uint64_t ata_identify() {
+    arch::x86_64::io::outb(ATA_HDDEVSEL, 0xA0);
+    arch::x86_64::io::outb(ATA_SECCOUNT0, 0);
+    arch::x86_64::io::outb(ATA_LBA0, 0);
+    arch::x86_64::io::outb(ATA_LBA1, 0);
+    arch::x86_64::io::outb(ATA_LBA2, 0);
+    arch::x86_64::io::outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+    // No drive answers 0, a floating bus reads back all ones
+    uint8_t status = arch::x86_64::io::inb(ATA_STATUS);
+    if (status == 0 || status == 0xFF) return 0;
+
+    int polls = 0;
+    while ((status = arch::x86_64::io::inb(ATA_STATUS)) & ATA_SR_BSY) {
+        if (++polls == ATA_IDENTIFY_POLLS) return 0;
+    }
+
+    // ATAPI and SATA signatures, not a plain ATA disk
+    if (arch::x86_64::io::inb(ATA_LBA1) || arch::x86_64::io::inb(ATA_LBA2)) return 0;
+
+    while (!(status & (ATA_SR_DRQ | ATA_SR_ERR))) {
+        if (++polls == ATA_IDENTIFY_POLLS) return 0;
+        status = arch::x86_64::io::inb(ATA_STATUS);
+    }
+    if (status & ATA_SR_ERR) return 0;
+
+    uint16_t id[256];
+    for (int w = 0; w < 256; w++) {
+        id[w] = arch::x86_64::io::inw(ATA_DATA);
+    }
+
+    uint64_t lba48 = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                     ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    return lba48 ? lba48 : ((uint64_t)id[60] | ((uint64_t)id[61] << 16));
+}
+
 ssize_t ahci_transfer(int port_id, uint64_t lba, size_t sector_count, void* buffer, bool is_write_op) {
 
 }
@@ -202,4 +250,29 @@ ssize_t ahci_driver_write(int port_id, uint64_t lba, size_t sector_count, void*
     }
 }
 
+static ssize_t block_read(void* ctx, uint64_t lba, size_t count, void* buf) {
+    return ahci_driver_read((int)(uintptr_t)ctx, lba, count, buf);
+}
+
+static ssize_t block_write(void* ctx, uint64_t lba, size_t count, const void* buf) {
+    return ahci_driver_write((int)(uintptr_t)ctx, lba, count, const_cast<void*>(buf));
+}
+
+static const devfs::block_ops disk_ops = { .read = block_read, .write = block_write };
+
+// Disk access goes through /dev so the page cache sits in front of it.
+// Only the legacy ATA path can transfer sectors so far.
+static void register_disks() {
+    if (!ATA_MODE) return;
+
+    uint64_t sectors = ata_identify();
+    if (!sectors) {
+        Log::warnf("No ATA disk on the primary channel");
+        return;
+    }
+    if (devfs::register_block("ata0", &disk_ops, (void*)0, sectors) == 0) {
+        Log::infof("ata0: %llu sectors", sectors);
+    }
+}
+
 }
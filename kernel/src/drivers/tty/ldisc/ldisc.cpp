@@ -3,6 +3,7 @@
 #include <drivers/input/ps2k/ps2k.hpp>
 #include <drivers/input/ps2k/ps2k_key_event.hpp>
 #include <drivers/input/ps2k/ps2k_keycodes.hpp>
+#include <arch/arch.hpp>
 #include <cstdio>
 
 enum line_discipline_mode : int {
@@ -138,7 +139,8 @@ ssize_t builtin_ldisc_read(bool echo, void* buf, size_t n) {
 
     set(echo, (char*)buf, n);
 
-    while (!read_done());
+    // The CPU has nothing else to do until a key arrives
+    while (!read_done()) arch::x86_64::cpu::idle(read_done);
 
     size_t count = read_count();
     reset();
@@ -3,6 +3,8 @@
 #include <cstring>
 #include <mem/vmm.hpp>
 #include <mem/pmm.hpp>
+#include <mem/vma.hpp>
+#include <vfs/vfs.hpp>
 #include <arch/arch.hpp>
 #include <cstdio>
 
@@ -52,6 +54,9 @@ constexpr uint16_t ET_DYN  = 3;
 constexpr uint32_t PT_LOAD = 1;
 constexpr uint32_t PT_DYNAMIC = 2;
 
+constexpr uint32_t PF_X = 1;
+constexpr uint32_t PF_W = 2;
+
 constexpr int64_t DT_NULL    = 0;
 constexpr int64_t DT_RELA    = 7;
 constexpr int64_t DT_RELASZ  = 8;
@@ -95,6 +100,50 @@ static void apply_relocations(void* load_base, Elf64_Phdr* phdrs, int phnum) {
     }
 }
 
+static inline uint64_t page_down(uint64_t va) { return va & ~(PAGE_SIZE - 1); }
+static inline uint64_t page_up(uint64_t va) { return (va + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1); }
+
+static int next_load(Elf64_Phdr* phdr, int phnum, int i) {
+    for (i++; i < phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD) return i;
+    }
+    return -1;
+}
+
+// A page that several segments share gets a VMA of its own with the union
+// of their permissions, filled from all of them right away
+static bool map_shared_page(mem::vma::mm* mm, void* base, Elf64_Phdr* phdr, int phnum,
+                            uint64_t bias, uint64_t page) {
+    void* frame = mem::pmm::palloc_zeroed();
+    if (!frame) return false;
+    uint8_t* dst = reinterpret_cast<uint8_t*>(mem::vmm::pa_to_va((uint64_t)frame));
+
+    uint32_t prot = VMA_USER | VMA_READ;
+    for (int i = 0; i < phnum; i++) {
+        if (phdr[i].p_type != PT_LOAD) continue;
+        uint64_t seg_base = bias + phdr[i].p_vaddr;
+        if (page_down(seg_base) > page || page_up(seg_base + phdr[i].p_memsz) <= page) continue;
+
+        if (phdr[i].p_flags & PF_W) prot |= VMA_WRITE;
+        if (phdr[i].p_flags & PF_X) prot |= VMA_EXEC;
+
+        uint64_t lo = seg_base > page ? seg_base : page;
+        uint64_t hi = seg_base + phdr[i].p_filesz;
+        if (hi > page + PAGE_SIZE) hi = page + PAGE_SIZE;
+        if (lo < hi) {
+            mem::memcpy(dst + (lo - page), reinterpret_cast<uint8_t*>(base) + phdr[i].p_offset + (lo - seg_base), hi - lo);
+        }
+    }
+
+    mem::pmm::phys_to_page((uint64_t)frame)->refcount = 1;
+    if (!mem::vma::map_anon(mm, page, PAGE_SIZE, prot, VMA_ANON) ||
+        !mem::vma::install_page(mm, page, (uint64_t)frame)) {
+        mem::pmm::page_put((uint64_t)frame);
+        return false;
+    }
+    return true;
+}
+
 void run_elf(void* base, size_t filesz) {
     auto* ehdr = reinterpret_cast<Elf64_Ehdr*>(base);
 
@@ -108,48 +157,68 @@ void run_elf(void* base, size_t filesz) {
     auto* phdr = reinterpret_cast<Elf64_Phdr*>(
         reinterpret_cast<uint8_t*>(base) + ehdr->e_phoff);
 
+    mem::vma::mm* mm = mem::vma::create_mm();
+    if (!mm) return;
+
+    // Segments only get VMAs here, their pages are copied in from the
+    // image by the page fault handler on first touch. Pages shared with the
+    // previous or next segment are left to map_shared_page.
+    uint64_t bias = (ehdr->e_type == ET_DYN) ? (uint64_t)load_base : 0;
+    uint64_t prev_end = 0, last_shared = ~0ULL;
     for (int i = 0; i < ehdr->e_phnum; i++) {
         if (phdr[i].p_type != PT_LOAD) continue;
 
-        void* seg_base = (ehdr->e_type == ET_DYN) ? (void*)((uint64_t)load_base + phdr[i].p_vaddr)
-                                                      : (void*)(phdr[i].p_vaddr);
-        size_t memsz = phdr[i].p_memsz;
-        size_t filesz = phdr[i].p_filesz;
-        void* offset = (void*)(phdr[i].p_offset);
-
-        void* map_start = (void*)((uint64_t)seg_base & ~(PAGE_SIZE - 1));
-        void* map_end   = (void*)(((uint64_t)seg_base + memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
-        size_t map_pages = ((uint64_t)map_end - (uint64_t)map_start) / PAGE_SIZE;
-
-        for (size_t p = 0; p < map_pages; p++) {
-            void* page_addr = map_start + p * PAGE_SIZE;
-            mem::vmm::munmap(reinterpret_cast<void*>(page_addr), 1); // ensure it is unmapped
-            void* page = mem::vmm::valloc(1);
-            mem::vmm::mmap(page, page, 1, PAGE_PRESENT | PAGE_RW | PAGE_USER);
-            uint64_t ret = mem::vmm::mmap(reinterpret_cast<void*>(page_addr),
-                           page,
-                           1,
-                           PAGE_PRESENT | PAGE_RW | PAGE_USER);
-            mem::vmm::mmap((void*)0x400000, (void*)0x400000, 1, PAGE_PRESENT | PAGE_RW | PAGE_USER);
+        uint64_t seg_base = bias + phdr[i].p_vaddr;
+        uint64_t map_start = page_down(seg_base);
+        uint64_t map_end   = page_up(seg_base + phdr[i].p_memsz);
+        if (map_start < prev_end) map_start = prev_end;
+        if (map_end > prev_end) prev_end = map_end;
+
+        uint64_t shared = ~0ULL;
+        int next = next_load(phdr, ehdr->e_phnum, i);
+        if (next >= 0 && page_down(bias + phdr[next].p_vaddr) < map_end) {
+            shared = page_down(bias + phdr[next].p_vaddr);
+            map_end = shared;
         }
 
-        mem::memcpy(reinterpret_cast<void*>(seg_base),
-                    reinterpret_cast<uint8_t*>(base) + (uint64_t)offset,
-                    filesz);
-        if (memsz > filesz) {
-            mem::memset(reinterpret_cast<uint8_t*>(seg_base) + filesz, 0, memsz - filesz);
+        uint32_t prot = VMA_USER | VMA_READ;
+        if (phdr[i].p_flags & PF_W) prot |= VMA_WRITE;
+        if (phdr[i].p_flags & PF_X) prot |= VMA_EXEC;
+
+        bool ok = map_start >= map_end ||
+                  mem::vma::map_file(mm, map_start, map_end - map_start, prot,
+                                     reinterpret_cast<uint8_t*>(base) + phdr[i].p_offset,
+                                     seg_base, phdr[i].p_filesz);
+        if (ok && shared != ~0ULL && shared != last_shared) {
+            ok = map_shared_page(mm, base, phdr, ehdr->e_phnum, bias, shared);
+            last_shared = shared;
+        }
+        if (!ok) {
+            Log::errf("ELF: failed to map segment %d", i);
+            mem::vma::destroy_mm(mm);
+            return;
         }
     }
 
-    if (ehdr->e_type == ET_DYN) {
-        apply_relocations(reinterpret_cast<void*>(load_base), phdr, ehdr->e_phnum);
+    if (!mem::vma::map_anon(mm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE,
+                            VMA_USER | VMA_READ | VMA_WRITE, VMA_STACK)) {
+        mem::vma::destroy_mm(mm);
+        return;
     }
 
-    void* stack_phys1 = mem::pmm::palloc(1);
-    void* stack_phys2 = mem::pmm::palloc(1);
+    // The program gets its own descriptors, starting as copies of ours
+    vfs::fdtable* files = vfs::clone_fdtable(vfs::current_fdtable());
+    if (!files) {
+        mem::vma::destroy_mm(mm);
+        return;
+    }
+
+    mem::vma::switch_mm(mm);
+    vfs::switch_fdtable(files);
 
-    mem::vmm::mmap(stack_phys1, stack_phys1, 1, PAGE_PRESENT | PAGE_RW | PAGE_USER);
-    mem::vmm::mmap(stack_phys2, stack_phys2, 1, PAGE_PRESENT | PAGE_RW | PAGE_USER);
+    if (ehdr->e_type == ET_DYN) {
+        apply_relocations(reinterpret_cast<void*>(load_base), phdr, ehdr->e_phnum);
+    }
 
     void* entry_addr = (ehdr->e_type == ET_DYN)
                                ? (void*)(load_base + ehdr->e_entry)
@@ -157,5 +226,5 @@ void run_elf(void* base, size_t filesz) {
 
     arch::x86_64::ringctl::execute_ring3(
         reinterpret_cast<void(*)()>(entry_addr),
-        reinterpret_cast<uint8_t*>(stack_phys2) + PAGE_SIZE);
+        reinterpret_cast<void*>(USER_STACK_TOP));
 }
@@ -3,6 +3,8 @@
 
 #include <cstddef>
 
+// base must stay mapped while the program runs, its segments are paged in
+// from it on demand
 void run_elf(void* base, size_t filesz);
 
 #endif
@@ -841,6 +841,9 @@ static void flanterm_fb_double_buffer_flush(struct flanterm_context *_ctx) {
     ctx->old_cursor_y = ctx->cursor_y;
 
     ctx->queue_i = 0;
+
+    // Drain the write-combining buffers so the frame is visible now
+    __asm__ volatile ("sfence" ::: "memory");
 }
 
 static void flanterm_fb_raw_putchar(struct flanterm_context *_ctx, uint8_t c) {
@@ -10,6 +10,8 @@ volatile struct limine_framebuffer_request fb_request = {
     .revision = 0
 };
 
+void* vmm_map_framebuffer(void* vaddr, size_t size);
+
 struct limine_framebuffer* fb;
 struct flanterm_context *ft_ctx;
 
@@ -22,6 +24,10 @@ void flanterm_initialise() {
 
     fb = fb_request.response->framebuffers[0];
 
+    /* remap write-combining, the MTRRs usually make the direct map uncached here */
+    void* address = vmm_map_framebuffer(fb->address, fb->height * fb->pitch);
+    if (address) fb->address = address;
+
     ft_ctx = flanterm_fb_init(
         NULL,
         NULL,
@@ -1,6 +1,38 @@
 #include "cstring"
 #include <mem/mem.hpp>
 
+// Word-at-a-time helpers. Loads are 8-byte aligned on at least one side,
+// so reading past a terminator never touches the next page.
+typedef uint64_t __attribute__((may_alias)) word_t;
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_word_t;
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// High bit set in each zero byte of v. Bytes above the first zero may
+// be flagged too, so only the lowest bit is exact (x86 is little endian).
+static inline uint64_t zero_bytes(uint64_t v) {
+    return (v - ONES) & ~v & HIGHS;
+}
+
+static inline uint64_t match_bytes(uint64_t v, unsigned char c) {
+    return zero_bytes(v ^ (c * ONES));
+}
+
+// Index of the byte the lowest flagged bit of mask belongs to
+static inline unsigned first_byte(uint64_t mask) {
+    return __builtin_ctzll(mask) / 8;
+}
+
+static inline bool aligned_word(const void* p) {
+    return ((uintptr_t)p & 7) == 0;
+}
+
+// An unaligned 8-byte load starting at p stays inside p's page
+static inline bool word_in_page(const void* p) {
+    return ((uintptr_t)p & 0xFFF) <= 0xFF8;
+}
+
 char* strcpy(char* dest, const char* src) {
     char* ptr = dest;
     while ((*ptr++ = *src++));
@@ -8,30 +40,63 @@ char* strcpy(char* dest, const char* src) {
 }
 
 char* strncpy(char* dest, const char* src, unsigned int n) {
-    char* ptr = dest;
     unsigned int i = 0;
-    while (i < n && src[i]) {
-        ptr[i] = src[i];
+    while (i < n && !aligned_word(src + i)) {
+        if (!(dest[i] = src[i])) break;
         i++;
     }
-    while (i < n) {
-        ptr[i++] = '\0';
+    if (i < n && src[i]) {
+        while (n - i >= 8) {
+            uint64_t v = *(const word_t*)(src + i);
+            if (zero_bytes(v)) break;
+            *(unaligned_word_t*)(dest + i) = v;
+            i += 8;
+        }
+        while (i < n && src[i]) {
+            dest[i] = src[i];
+            i++;
+        }
     }
+    if (i < n) mem::memset(dest + i, 0, n - i);
     return dest;
 }
 
 unsigned int strlen(const char* str) {
-    unsigned int len = 0;
-    while (str[len]) len++;
-    return len;
+    const char* p = str;
+    while (!aligned_word(p)) {
+        if (!*p) return p - str;
+        p++;
+    }
+    uint64_t zeros;
+    while (!(zeros = zero_bytes(*(const word_t*)p))) p += 8;
+    return p + first_byte(zeros) - str;
 }
 
 int strcmp(const char* s1, const char* s2) {
-    while (*s1 && (*s1 == *s2)) {
+    // Most mismatches (sibling names in a lookup) differ in the first byte
+    if (*s1 != *s2 || !*s1) return (unsigned char)*s1 - (unsigned char)*s2;
+    while (!aligned_word(s1)) {
+        if (!*s1 || *s1 != *s2) return (unsigned char)*s1 - (unsigned char)*s2;
         s1++;
         s2++;
     }
-    return (unsigned char)*s1 - (unsigned char)*s2;
+    for (;;) {
+        if (!word_in_page(s2)) {
+            // Byte steps until s2's next word is back inside one page
+            for (int i = 0; i < 8; i++, s1++, s2++) {
+                if (!*s1 || *s1 != *s2) return (unsigned char)*s1 - (unsigned char)*s2;
+            }
+            continue;
+        }
+        uint64_t a = *(const word_t*)s1, b = *(const unaligned_word_t*)s2;
+        uint64_t stop = (a ^ b) | zero_bytes(a);
+        if (stop) {
+            unsigned shift = first_byte(stop) * 8;
+            return (int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF);
+        }
+        s1 += 8;
+        s2 += 8;
+    }
 }
 
 int strncmp(const char* s1, const char* s2, unsigned int n) {
@@ -62,24 +127,96 @@ char* strncat(char* dest, const char* src, unsigned int n) {
 }
 
 char* strchr(const char* str, int c) {
-    while (*str) {
-        if (*str == (char)c) return (char*)str;
+    unsigned char ch = (unsigned char)c;
+    while (!aligned_word(str)) {
+        if (!*str) return nullptr;
+        if (*str == (char)ch) return (char*)str;
         str++;
     }
-    return nullptr;
+    for (;;) {
+        uint64_t v = *(const word_t*)str;
+        uint64_t stop = zero_bytes(v) | match_bytes(v, ch);
+        if (stop) {
+            str += first_byte(stop);
+            return *str ? (char*)str : nullptr;
+        }
+        str += 8;
+    }
 }
 
+// Crochemore-Perrin critical factorisation: splits the needle where the
+// lexicographically largest suffix (for either byte order) starts.
+static size_t critical_factorisation(const unsigned char* needle, size_t len, size_t* period) {
+    size_t max_suffix = (size_t)-1, max_suffix_rev = (size_t)-1;
+    size_t j = 0, k = 1, p = 1;
+
+    while (j + k < len) {
+        unsigned char a = needle[j + k], b = needle[max_suffix + k];
+        if (a < b) { j += k; k = 1; p = j - max_suffix; }
+        else if (a == b) { if (k != p) k++; else { j += p; k = 1; } }
+        else { max_suffix = j++; k = p = 1; }
+    }
+    *period = p;
+
+    j = 0; k = p = 1;
+    while (j + k < len) {
+        unsigned char a = needle[j + k], b = needle[max_suffix_rev + k];
+        if (b < a) { j += k; k = 1; p = j - max_suffix_rev; }
+        else if (a == b) { if (k != p) k++; else { j += p; k = 1; } }
+        else { max_suffix_rev = j++; k = p = 1; }
+    }
+
+    if (max_suffix_rev + 1 < max_suffix + 1) return max_suffix + 1;
+    *period = p;
+    return max_suffix_rev + 1;
+}
+
+// Two-way string matching, linear in the haystack with O(1) extra space
 char* strstr(const char* haystack, const char* needle) {
     if (!*needle) return (char*)haystack;
-    while (*haystack) {
-        const char* h = haystack;
-        const char* n = needle;
-        while (*h && *n && (*h == *n)) {
-            h++;
-            n++;
+    haystack = strchr(haystack, *needle);
+    if (!haystack || !needle[1]) return (char*)haystack;
+
+    const unsigned char* h = (const unsigned char*)haystack;
+    const unsigned char* n = (const unsigned char*)needle;
+    size_t nlen = strlen(needle), hlen = strlen(haystack);
+    if (hlen < nlen) return nullptr;
+
+    size_t period;
+    size_t suffix = critical_factorisation(n, nlen, &period);
+    size_t j = 0;
+
+    if (mem::memcmp(n, n + period, suffix) == 0) {
+        // Periodic needle, remember how much of the last period matched
+        size_t memory = 0;
+        while (j <= hlen - nlen) {
+            size_t i = suffix > memory ? suffix : memory;
+            while (i < nlen && n[i] == h[i + j]) i++;
+            if (i >= nlen) {
+                i = suffix - 1;
+                while (memory < i + 1 && n[i] == h[i + j]) i--;
+                if (i + 1 < memory + 1) return (char*)(h + j);
+                j += period;
+                memory = nlen - period;
+            } else {
+                j += i - suffix + 1;
+                memory = 0;
+            }
+        }
+    } else {
+        period = (suffix > nlen - suffix ? suffix : nlen - suffix) + 1;
+        while (j <= hlen - nlen) {
+            size_t i = suffix;
+            while (i < nlen && n[i] == h[i + j]) i++;
+            if (i >= nlen) {
+                i = suffix - 1;
+                while (i != (size_t)-1 && n[i] == h[i + j]) i--;
+                if (i == (size_t)-1) return (char*)(h + j);
+                j += period;
+            } else {
+                j += i - suffix + 1;
+            }
         }
-        if (!*n) return (char*)haystack;
-        haystack++;
     }
     return nullptr;
 }
@@ -10,7 +10,9 @@
 #include <uacpi/uacpi.h>
 #include <uacpi/event.h>
 #include <uacpi/tables.h>
+#include <vfs/vfs.hpp>
 #include <tmpfs/tmpfs.hpp>
+#include <devfs/devfs.hpp>
 #include <pci/pci.hpp>
 #include <drivers/blockio/ahci.hpp>
 #include <exec/elf.hpp>
@@ -19,6 +21,8 @@
 #include <pcie/pcie.hpp>
 #include <drivers/tty/ldisc/ldisc.hpp>
 #include <drivers/input/ps2m/ps2m.hpp>
+#include <config.hpp>
+#include <mem/memprof.hpp>
 
 #define UACPI_ERROR(name, isinit) \
 if (uacpi_unlikely_error(uacpi_result)) { \
@@ -43,6 +47,8 @@ extern "C" void init() {
         asm volatile ("cli;hlt");
     }
 
+    arch::x86_64::cpu::fpu::initialise();
+
     mem::pmm::initialise();
     
     mem::vmm::initialise();
@@ -53,7 +59,14 @@ extern "C" void init() {
     Log::printf_status("OK", "VMM Initialised"); // late
     Log::printf_status("OK", "PMM Initialised"); // late
     Log::printf_status("OK", "Flanterm Initialised"); // late
+    Log::printf_status("OK", "FPU Initialised (ERMS=%d FSRM=%d AVX2=%d)", // late
+                       arch::x86_64::cpu::features.erms, arch::x86_64::cpu::features.fsrm,
+                       arch::x86_64::cpu::features.avx2);
     Log::printf_status("OK", "Serial Initialised");
+
+#ifdef CONFIG_PMM_SELFTEST
+    mem::pmm::selftest();
+#endif
     
     arch::x86_64::cpu::gdt::initialise();
     Log::printf_status("OK", "GDT Initialised");
@@ -65,6 +78,13 @@ extern "C" void init() {
 
     mem::heap::initialise();
     Log::printf_status("OK", "Heap Initialised");
+
+#ifdef CONFIG_HEAP_BENCH
+    mem::heap::benchmark();
+#endif
+#ifdef CONFIG_VMM_PCID_BENCH
+    mem::vmm::pcid_benchmark();
+#endif
     
     drivers::timers::pit::initialise();
     Log::printf_status("OK", "PIT Initialised (FREQ=300)");
@@ -94,13 +114,23 @@ extern "C" void init() {
     uacpi_result = uacpi_finalize_gpe_initialization();
     UACPI_ERROR("GPE", 0);
 
+	vfs::initialise();
 	tmpfs::initialise();
-    tmpfs::mkdir("/dev", 0777);
-    int stdin = tmpfs::open("/dev/stdin", O_CREAT | O_RDWR);
-    int stdout = tmpfs::open("/dev/stdout", O_CREAT | O_RDWR);
-    int stderr = tmpfs::open("/dev/stderr", O_CREAT | O_RDWR);
+	devfs::initialise();
+    vfs::mount("tmpfs", "/");
+    vfs::mkdir("/dev", 0777);
+    vfs::mount("devfs", "/dev");
+    int stdin = vfs::open("/dev/stdin", O_RDWR);
+    int stdout = vfs::open("/dev/stdout", O_RDWR);
+    int stderr = vfs::open("/dev/stderr", O_RDWR);
     tmpfs::load_initrd(module_request.response->modules[0]->address, module_request.response->modules[0]->size);
-    Log::printf_status("OK", "TMPFS Initialised");
+    devfs::register_memory("initrd", module_request.response->modules[0]->address, module_request.response->modules[0]->size);
+    Log::printf_status("OK", "VFS Initialised");
+
+#ifdef CONFIG_MEM_PROFILE
+    mem::prof::report();
+    mem::prof::initialise();
+#endif
 
     uint64_t npci = pci::initialise();
     Log::printf_status("OK", "Detected %zu PCI devices (Normal PCI is deprecated, use PCIe)", npci);
@@ -129,7 +159,7 @@ extern "C" void init() {
     	size_t read = drivers::tty::ldisc::read(true, buf, 4096);
     	if (read > 0) printf("Read %zu characters: %s\n\r", read, buf);
         else printf("Nothing written, how lazy...\n\r");
-        asm volatile("hlt");
+        arch::x86_64::cpu::idle(nullptr);
     }
     
     __builtin_unreachable();
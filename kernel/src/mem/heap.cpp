@@ -1,245 +1,699 @@
-#include <mem/mem.hpp>
-#include <mem/heap.hpp>
-#include <cstdio>
-
-void* heap_base = nullptr;
-size_t heap_size = 0;
-
-struct heap_block {
-    void* base;
-    size_t length;
-    bool is_free;
-    heap_block* prev;
-    heap_block* next;
-};
-
-namespace mem::heap {
-
-void initialise() {
-    const size_t initial_size = 0x100000000;
-    const size_t min_heap_size = 0x100000;
-    size_t divisor = 1;
-    heap_base = nullptr;
-
-    while (heap_base == nullptr && initial_size / divisor >= min_heap_size) {
-        heap_size = initial_size / divisor;
-        size_t num_pages = heap_size / 0x1000;
-
-        heap_base = mem::pmm::reserve_heap(num_pages);
-
-        if (heap_base != nullptr) {
-        } else {
-        }
-
-        divisor *= 2;
-    }
-
-    if (heap_base == nullptr) {
-    } else {
-    }
-
-    heap_base = (void*)mem::vmm::pa_to_va((uint64_t)heap_base);
-
-    heap_block* first_block = (heap_block*)heap_base;
-    first_block->base = (void*)((uint8_t*)first_block + sizeof(heap_block));
-    first_block->length = heap_size - sizeof(heap_block);
-    first_block->is_free = true;
-    first_block->prev = nullptr;
-    first_block->next = nullptr;
-}
-
-void defragment() {
-    if (heap_base == nullptr) {
-        Log::errf("Heap not initialized, cannot defragment");
-        return;
-    }
-
-    heap_block* current = (heap_block*)heap_base;
-    while (current != nullptr) {
-        if (current->is_free && current->next != nullptr && current->next->is_free) {
-            current->length += current->next->length + sizeof(heap_block);
-            current->next = current->next->next;
-
-            if (current->next != nullptr) {
-                current->next->prev = current;
-            }
-        } else {
-            current = current->next;
-        }
-    }
-}
-
-void* malloc(size_t n) {
-    heap_block* current = (heap_block*)heap_base;
-    heap_block* best_fit = nullptr;
-
-    while (current != nullptr) {
-        if (current->is_free && current->length >= n) {
-            if (best_fit == nullptr || current->length < best_fit->length) {
-                best_fit = current;
-            }
-        }
-        current = current->next;
-    }
-
-    if (best_fit == nullptr) {
-        Log::errf("Malloc: No suitable free block found for %zu bytes", n);
-        return nullptr;
-    }
-
-    if (best_fit->length > n + sizeof(heap_block)) {
-        heap_block* new_block = (heap_block*)((uint8_t*)best_fit + sizeof(heap_block) + n);
-        new_block->base = (void*)((uint8_t*)new_block + sizeof(heap_block));
-        new_block->length = best_fit->length - n - sizeof(heap_block);
-        new_block->is_free = true;
-        new_block->next = best_fit->next;
-        if (best_fit->next) {
-            best_fit->next->prev = new_block;
-        }
-        best_fit->next = new_block;
-        new_block->prev = best_fit;
-        best_fit->length = n;
-    }
-
-    best_fit->is_free = false;
-    return best_fit->base;
-}
-
-void* malloc_aligned(size_t n, size_t alignment) {
-    if ((alignment & (alignment - 1)) != 0) return nullptr;
-
-    heap_block* current = (heap_block*)heap_base;
-    heap_block* best_fit = nullptr;
-
-    while (current != nullptr) {
-        if (current->is_free && current->length >= n + alignment) {
-            if (best_fit == nullptr || current->length < best_fit->length) {
-                best_fit = current;
-            }
-        }
-        current = current->next;
-    }
-
-    if (best_fit == nullptr) {
-        Log::errf("malloc_aligned: No suitable free block found for %zu bytes", n);
-        return nullptr;
-    }
-
-    uintptr_t raw_addr = (uintptr_t)best_fit->base;
-    uintptr_t aligned_addr = (raw_addr + alignment - 1) & ~(alignment - 1);
-    size_t padding = aligned_addr - raw_addr;
-
-    if (padding > 0) {
-        if (best_fit->length <= padding + sizeof(heap_block)) {
-            return nullptr;
-        }
-
-        heap_block* pad_block = (heap_block*)((uint8_t*)best_fit + sizeof(heap_block) + padding);
-        pad_block->base = (void*)((uint8_t*)pad_block + sizeof(heap_block));
-        pad_block->length = best_fit->length - padding - sizeof(heap_block);
-        pad_block->is_free = true;
-        pad_block->next = best_fit->next;
-        if (best_fit->next) best_fit->next->prev = pad_block;
-        pad_block->prev = best_fit;
-
-        best_fit->length = padding;
-        best_fit->next = pad_block;
-        best_fit = pad_block;
-    }
-
-    if (best_fit->length > n + sizeof(heap_block)) {
-        heap_block* new_block = (heap_block*)((uint8_t*)best_fit + sizeof(heap_block) + n);
-        new_block->base = (void*)((uint8_t*)new_block + sizeof(heap_block));
-        new_block->length = best_fit->length - n - sizeof(heap_block);
-        new_block->is_free = true;
-        new_block->next = best_fit->next;
-        if (best_fit->next) new_block->next->prev = new_block;
-        new_block->prev = best_fit;
-        best_fit->next = new_block;
-        best_fit->length = n;
-    }
-
-    best_fit->is_free = false;
-    return best_fit->base;
-}
-
-void* realloc(void* ptr, size_t n) {
-    if (ptr == nullptr) {
-        return malloc(n);
-    }
-
-    if (n == 0) {
-        free(ptr);
-        return nullptr;
-    }
-
-    heap_block* current = (heap_block*)heap_base;
-    while (current != nullptr) {
-        if (current->base == ptr) {
-            if (current->length >= n) {
-                current->length = n;
-                return current->base;
-            }
-
-            void* new_ptr = malloc(n);
-            if (new_ptr) {
-                memcpy(new_ptr, ptr, current->length);
-                free(ptr);
-                return new_ptr;
-            }
-
-            Log::errf("Realloc: Failed to allocate %zu bytes", n);
-            return nullptr;
-        }
-        current = current->next;
-    }
-
-    Log::errf("Realloc: Failed to find memory block for %p", ptr);
-    return nullptr;
-}
-
-void* calloc(size_t n, size_t size) {
-    size_t total_size = n * size;
-
-    void* ptr = malloc(total_size);
-    if (ptr) {
-        memset(ptr, 0, total_size);
-    }
-
-    return ptr;
-}
-
-void free(void* ptr) {
-    if (ptr == nullptr) {
-        return;
-    }
-
-    heap_block* current = (heap_block*)heap_base;
-    while (current != nullptr) {
-        if (current->base == ptr) {
-            current->is_free = true;
-            if (current->next && current->next->is_free) {
-                current->length += current->next->length + sizeof(heap_block);
-                current->next = current->next->next;
-                if (current->next) {
-                    current->next->prev = current;
-                }
-            }
-
-            if (current->prev && current->prev->is_free) {
-                current->prev->length += current->length + sizeof(heap_block);
-                current->prev->next = current->next;
-                if (current->next) {
-                    current->next->prev = current->prev;
-                }
-            }
-
-            return;
-        }
-        current = current->next;
-    }
-
-    Log::errf("Free: Attempted to free a block that wasn't allocated: %p", ptr);
-}
-
-}
+#include <mem/mem.hpp>
+#include <mem/heap.hpp>
+#include <mem/memprof.hpp>
+#include <sync/spinlock.hpp>
+#include <arch/arch.hpp>
+#include <config.hpp>
+#include <cstdio>
+
+#define PAGE_SIZE 4096
+
+#define MIN_CLASS_SHIFT 4   // 16 bytes
+#define MAX_CLASS_SHIFT 12  // 4096 bytes
+#define NUM_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+
+#define ARENA_CHUNK_PAGES 256                   // 1 MiB chunks
+#define ARENA_CHUNK_SIZE (ARENA_CHUNK_PAGES * PAGE_SIZE)
+#define ARENA_CHUNKS (KHEAP_SIZE / ARENA_CHUNK_SIZE)
+#define ARENA_CHUNK_FREE (ARENA_CHUNK_SIZE - 4 * sizeof(size_t))   // one block spanning a whole chunk
+#define ARENA_MAX_ALLOC (256 * 1024)            // bigger requests get whole pages
+#define ARENA_ALIGN 16
+#define ARENA_OVERHEAD (3 * sizeof(size_t))    // header and footer
+#define ARENA_MIN_BLOCK 48
+#define ARENA_BINS 21                           // bin i holds blocks of [2^i, 2^(i+1))
+#define ARENA_USED 0x1
+#define ARENA_MAGIC 0x6865617074616773ULL
+#define SLAB_POISON 0x736c616266726565ULL    // second word of a free slab object, xor its address
+
+using mem::pmm::page;
+
+// A size class. Each slab is a single page whose free objects are chained
+// through their first word; the slab's bookkeeping lives in its struct page.
+struct slab_cache {
+    size_t size;
+    uint32_t objects_per_slab;
+    page* partial;          // slabs with at least one free object
+    page* empty;            // at most one fully free slab is kept around
+    sync::spinlock lock;
+};
+
+static slab_cache caches[NUM_CLASSES];
+
+// Boundary-tag block in an arena chunk. The size word is repeated in a
+// footer at the end of the block so both neighbours can be found in O(1);
+// free blocks keep their free list links in the payload.
+struct arena_block {
+    size_t tag;             // block size | ARENA_USED
+    size_t magic;
+    arena_block* next_free;
+    arena_block* prev_free;
+};
+
+static arena_block* arena_bins[ARENA_BINS];
+static uint32_t arena_bin_mask;
+static sync::spinlock arena_lock;
+
+// Chunk slots of the KHEAP window that are currently backed
+static uint64_t arena_chunk_map[ARENA_CHUNKS / 64];
+static uint64_t arena_chunk_hint;
+static uint64_t arena_empty_chunks;
+
+static inline int class_for(size_t n) {
+    if (n <= (1UL << MIN_CLASS_SHIFT)) return 0;
+    return (64 - __builtin_clzll(n - 1)) - MIN_CLASS_SHIFT;
+}
+
+static inline page* owner_page(void* ptr) {
+    return mem::pmm::phys_to_page(mem::vmm::va_to_pa((uint64_t)ptr));
+}
+
+static inline void* page_address(page* p) {
+    return (void*)mem::vmm::pa_to_va(mem::pmm::page_to_phys(p));
+}
+
+static void slab_list_add(page** head, page* p) {
+    p->prev = nullptr;
+    p->next = *head;
+    if (*head) (*head)->prev = p;
+    *head = p;
+}
+
+static void slab_list_remove(page** head, page* p) {
+    if (p->prev) p->prev->next = p->next;
+    else *head = p->next;
+    if (p->next) p->next->prev = p->prev;
+    p->next = p->prev = nullptr;
+}
+
+// Caller holds cache->lock
+static page* slab_grow(slab_cache* cache) {
+    void* pa = mem::pmm::palloc(1);
+    if (pa == nullptr) return nullptr;
+
+    page* p = mem::pmm::phys_to_page((uint64_t)pa);
+    uint8_t* base = (uint8_t*)mem::vmm::pa_to_va((uint64_t)pa);
+
+    void** link = &p->freelist;
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        void* obj = base + i * cache->size;
+        ((uint64_t*)obj)[1] = SLAB_POISON ^ (uint64_t)obj;
+        *link = obj;
+        link = (void**)obj;
+    }
+    *link = nullptr;
+
+    p->flags |= PG_SLAB;
+    p->slab_cache = cache;
+    p->inuse = 0;
+    return p;
+}
+
+static void* slab_alloc(slab_cache* cache) {
+    uint64_t flags = sync::lock_irqsave(&cache->lock);
+
+    page* p = cache->partial;
+    if (p == nullptr) {
+        if (cache->empty) {
+            p = cache->empty;
+            cache->empty = nullptr;
+        } else {
+            p = slab_grow(cache);
+        }
+
+        if (p == nullptr) {
+            sync::unlock_irqrestore(&cache->lock, flags);
+            return nullptr;
+        }
+        slab_list_add(&cache->partial, p);
+    }
+
+    void* obj = p->freelist;
+    p->freelist = *(void**)obj;
+    ((uint64_t*)obj)[1] = 0;
+    p->inuse++;
+
+    if (p->freelist == nullptr) {
+        slab_list_remove(&cache->partial, p);
+    }
+
+    sync::unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+// Caller holds cache->lock. Only a poisoned object can be free, the walk
+// tells a real double free apart from data that happens to match.
+static bool slab_is_free(page* p, void* ptr) {
+    if (((uint64_t*)ptr)[1] != (SLAB_POISON ^ (uint64_t)ptr)) return false;
+    for (void* obj = p->freelist; obj != nullptr; obj = *(void**)obj) {
+        if (obj == ptr) return true;
+    }
+    return false;
+}
+
+static void slab_free(page* p, void* ptr) {
+    slab_cache* cache = (slab_cache*)p->slab_cache;
+    uint64_t flags = sync::lock_irqsave(&cache->lock);
+
+    uint64_t offset = (uint64_t)ptr & (PAGE_SIZE - 1);
+    if (offset % cache->size || offset / cache->size >= cache->objects_per_slab ||
+        p->inuse == 0 || slab_is_free(p, ptr)) {
+        sync::unlock_irqrestore(&cache->lock, flags);
+        Log::errf("Free: Attempted to free a slab object that wasn't allocated: %p", ptr);
+        return;
+    }
+    ((uint64_t*)ptr)[1] = SLAB_POISON ^ (uint64_t)ptr;
+
+    bool was_full = p->freelist == nullptr;
+    *(void**)ptr = p->freelist;
+    p->freelist = ptr;
+    p->inuse--;
+
+    if (was_full) slab_list_add(&cache->partial, p);
+
+    page* release = nullptr;
+    if (p->inuse == 0) {
+        slab_list_remove(&cache->partial, p);
+        if (cache->empty == nullptr) {
+            cache->empty = p;
+        } else {
+            p->flags &= ~PG_SLAB;
+            p->slab_cache = nullptr;
+            release = p;
+        }
+    }
+
+    sync::unlock_irqrestore(&cache->lock, flags);
+
+    if (release) mem::pmm::free(page_address(release), 1);
+}
+
+static inline size_t block_size(arena_block* b) {
+    return b->tag & ~(size_t)ARENA_USED;
+}
+
+static inline bool block_used(arena_block* b) {
+    return b->tag & ARENA_USED;
+}
+
+static inline size_t* block_footer(arena_block* b) {
+    return (size_t*)((uint8_t*)b + block_size(b) - sizeof(size_t));
+}
+
+static inline void set_block(arena_block* b, size_t size, bool used) {
+    b->tag = size | (used ? ARENA_USED : 0);
+    b->magic = ARENA_MAGIC ^ (uint64_t)b;
+    *block_footer(b) = b->tag;
+}
+
+static inline void* block_payload(arena_block* b) {
+    return (uint8_t*)b + 2 * sizeof(size_t);
+}
+
+static inline arena_block* payload_block(void* ptr) {
+    return (arena_block*)((uint8_t*)ptr - 2 * sizeof(size_t));
+}
+
+static inline size_t block_usable(arena_block* b) {
+    return block_size(b) - ARENA_OVERHEAD;
+}
+
+static inline int bin_for(size_t size) {
+    int bin = 63 - __builtin_clzll(size);
+    return bin < ARENA_BINS ? bin : ARENA_BINS - 1;
+}
+
+static void arena_insert(arena_block* b) {
+    int bin = bin_for(block_size(b));
+    b->prev_free = nullptr;
+    b->next_free = arena_bins[bin];
+    if (arena_bins[bin]) arena_bins[bin]->prev_free = b;
+    arena_bins[bin] = b;
+    arena_bin_mask |= 1U << bin;
+}
+
+static void arena_remove(arena_block* b) {
+    int bin = bin_for(block_size(b));
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else arena_bins[bin] = b->next_free;
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+    if (arena_bins[bin] == nullptr) arena_bin_mask &= ~(1U << bin);
+}
+
+// Caller holds arena_lock. Carves a block of exactly `size` bytes off the
+// front of `b` when the remainder is big enough to stand on its own.
+static void arena_split(arena_block* b, size_t size) {
+    size_t total = block_size(b);
+    if (total - size < ARENA_MIN_BLOCK) {
+        set_block(b, total, true);
+        return;
+    }
+
+    set_block(b, size, true);
+    arena_block* rest = (arena_block*)((uint8_t*)b + size);
+    set_block(rest, total - size, false);
+    arena_insert(rest);
+}
+
+static inline bool is_arena(void* ptr) {
+    return (uint64_t)ptr >= KHEAP_BASE && (uint64_t)ptr < KHEAP_BASE + KHEAP_SIZE;
+}
+
+static void arena_unmap(uint8_t* base, size_t npages) {
+    uint64_t frames[ARENA_CHUNK_PAGES];
+    for (size_t i = 0; i < npages; i++) {
+        frames[i] = mem::vmm::translate(base + i * PAGE_SIZE);
+    }
+
+    // Frames may only be reused once no stale translation can reach them
+    mem::vmm::tlb_gather tlb;
+    mem::vmm::tlb_gather_init(&tlb);
+    bool unmapped = mem::vmm::unmap_range(&tlb, base, npages);
+    mem::vmm::tlb_gather_flush(&tlb);
+
+    // Some pages may still be mapped, leak the frames rather than reuse them
+    if (!unmapped) {
+        Log::errf("Heap: failed to unmap %p, leaking %zu pages", base, npages);
+        return;
+    }
+
+    for (size_t i = 0; i < npages; i++) {
+        if (frames[i]) mem::pmm::free((void*)mem::vmm::pa_to_va(frames[i]), 1);
+    }
+}
+
+// Caller holds arena_lock. Backs the next unused chunk slot of the
+// KHEAP window with fresh frames; they need not be contiguous.
+static bool arena_grow() {
+    uint64_t slot = arena_chunk_hint;
+    for (uint64_t n = 0; n < ARENA_CHUNKS; n++, slot = (slot + 1) % ARENA_CHUNKS) {
+        if (!(arena_chunk_map[slot / 64] & (1ULL << (slot % 64)))) break;
+    }
+    if (arena_chunk_map[slot / 64] & (1ULL << (slot % 64))) {
+        Log::errf("Heap: KHEAP window exhausted");
+        return false;
+    }
+
+    uint8_t* base = (uint8_t*)(KHEAP_BASE + slot * ARENA_CHUNK_SIZE);
+    uint64_t frames[ARENA_CHUNK_PAGES];
+    for (size_t i = 0; i < ARENA_CHUNK_PAGES; i++) {
+        frames[i] = (uint64_t)mem::pmm::palloc(1);
+        if (!frames[i]) {
+            while (i--) mem::pmm::free((void*)mem::vmm::pa_to_va(frames[i]), 1);
+            Log::errf("Heap: out of memory growing the arena");
+            return false;
+        }
+    }
+
+    // Physically contiguous frames go in with one map_range call each run
+    mem::vmm::tlb_gather tlb;
+    mem::vmm::tlb_gather_init(&tlb);
+    bool mapped = true;
+    for (size_t i = 0, run; mapped && i < ARENA_CHUNK_PAGES; i += run) {
+        for (run = 1; i + run < ARENA_CHUNK_PAGES; run++) {
+            if (frames[i + run] != frames[i] + run * PAGE_SIZE) break;
+        }
+        mapped = mem::vmm::map_range(&tlb, (void*)frames[i], base + i * PAGE_SIZE, run,
+                                     PAGE_PRESENT | PAGE_RW | PAGE_NX) != 0;
+    }
+    mem::vmm::tlb_gather_flush(&tlb);
+
+    if (!mapped) {
+        // arena_unmap frees what did get mapped, the rest goes back here
+        for (size_t i = 0; i < ARENA_CHUNK_PAGES; i++) {
+            if (!mem::vmm::translate(base + i * PAGE_SIZE)) {
+                mem::pmm::free((void*)mem::vmm::pa_to_va(frames[i]), 1);
+            }
+        }
+        arena_unmap(base, ARENA_CHUNK_PAGES);
+        Log::errf("Heap: failed to map a chunk at %p", base);
+        return false;
+    }
+
+    arena_chunk_map[slot / 64] |= 1ULL << (slot % 64);
+    arena_chunk_hint = (slot + 1) % ARENA_CHUNKS;
+
+    // Used prologue footer and epilogue header fence the chunk so
+    // coalescing never walks off either end
+    *(size_t*)(base + sizeof(size_t)) = ARENA_USED;
+    *(size_t*)(base + ARENA_CHUNK_SIZE - 2 * sizeof(size_t)) = ARENA_USED;
+
+    arena_block* b = (arena_block*)(base + 2 * sizeof(size_t));
+    set_block(b, ARENA_CHUNK_FREE, false);
+    arena_insert(b);
+    arena_empty_chunks++;
+    return true;
+}
+
+// Caller holds arena_lock. `b` spans a whole chunk; one empty chunk is kept
+// around so a malloc/free pair at the boundary does not remap every time.
+static void arena_release(arena_block* b) {
+    if (arena_empty_chunks++ == 0) return;
+
+    arena_remove(b);
+    arena_empty_chunks--;
+
+    uint8_t* base = (uint8_t*)b - 2 * sizeof(size_t);
+    uint64_t slot = ((uint64_t)base - KHEAP_BASE) / ARENA_CHUNK_SIZE;
+    arena_unmap(base, ARENA_CHUNK_PAGES);
+
+    arena_chunk_map[slot / 64] &= ~(1ULL << (slot % 64));
+    if (slot < arena_chunk_hint) arena_chunk_hint = slot;
+}
+
+// Caller holds arena_lock
+static arena_block* arena_find(size_t size) {
+    int bin = bin_for(size);
+
+    // Blocks in the request's own bin may be too small, so check them
+    for (arena_block* b = arena_bins[bin]; b != nullptr; b = b->next_free) {
+        if (block_size(b) >= size) return b;
+    }
+
+    // Any block in a higher bin is big enough, take the first one
+    uint32_t higher = arena_bin_mask & ~((2U << bin) - 1);
+    if (higher == 0) return nullptr;
+    return arena_bins[__builtin_ctz(higher)];
+}
+
+static inline size_t arena_request_size(size_t n) {
+    size_t size = (n + ARENA_OVERHEAD + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return size < ARENA_MIN_BLOCK ? ARENA_MIN_BLOCK : size;
+}
+
+static void* arena_alloc(size_t n) {
+    size_t size = arena_request_size(n);
+    uint64_t flags = sync::lock_irqsave(&arena_lock);
+
+    arena_block* b = arena_find(size);
+    if (b == nullptr && arena_grow()) {
+        b = arena_find(size);
+    }
+
+    if (b == nullptr) {
+        sync::unlock_irqrestore(&arena_lock, flags);
+        return nullptr;
+    }
+
+    if (block_size(b) == ARENA_CHUNK_FREE) arena_empty_chunks--;
+    arena_remove(b);
+    arena_split(b, size);
+
+    sync::unlock_irqrestore(&arena_lock, flags);
+    return block_payload(b);
+}
+
+static bool arena_valid(arena_block* b) {
+    return b->magic == (ARENA_MAGIC ^ (uint64_t)b) && block_used(b);
+}
+
+static void arena_free(void* ptr) {
+    arena_block* b = payload_block(ptr);
+    uint64_t flags = sync::lock_irqsave(&arena_lock);
+
+    if (!arena_valid(b)) {
+        sync::unlock_irqrestore(&arena_lock, flags);
+        Log::errf("Free: Attempted to free a block that wasn't allocated: %p", ptr);
+        return;
+    }
+
+    // Invalidate this header now, a backward merge leaves it in the middle
+    // of the free block where a second free would still find it valid
+    size_t size = block_size(b);
+    b->magic = 0;
+    b->tag = size;
+
+    arena_block* next = (arena_block*)((uint8_t*)b + size);
+    if (!block_used(next)) {
+        arena_remove(next);
+        size += block_size(next);
+    }
+
+    size_t prev_tag = *(size_t*)((uint8_t*)b - sizeof(size_t));
+    if (!(prev_tag & ARENA_USED)) {
+        arena_block* prev = (arena_block*)((uint8_t*)b - prev_tag);
+        arena_remove(prev);
+        size += prev_tag;
+        b = prev;
+    }
+
+    set_block(b, size, false);
+    b->magic = 0;
+    arena_insert(b);
+
+    if (size == ARENA_CHUNK_FREE) arena_release(b);
+
+    sync::unlock_irqrestore(&arena_lock, flags);
+}
+
+// Grows a block in place by absorbing a free right neighbour
+static bool arena_resize(arena_block* b, size_t n) {
+    size_t size = arena_request_size(n);
+    uint64_t flags = sync::lock_irqsave(&arena_lock);
+
+    size_t have = block_size(b);
+    if (have < size) {
+        arena_block* next = (arena_block*)((uint8_t*)b + have);
+        if (block_used(next) || have + block_size(next) < size) {
+            sync::unlock_irqrestore(&arena_lock, flags);
+            return false;
+        }
+        arena_remove(next);
+        have += block_size(next);
+        set_block(b, have, true);
+    }
+
+    arena_split(b, size);
+    sync::unlock_irqrestore(&arena_lock, flags);
+    return true;
+}
+
+static void* large_alloc(size_t n, size_t alignment) {
+    size_t npages = (n + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // Power-of-two buddy blocks are naturally aligned
+    if (alignment > PAGE_SIZE) {
+        size_t align_pages = alignment / PAGE_SIZE;
+        if (npages < align_pages) npages = align_pages;
+        npages = 1UL << (64 - __builtin_clzll(npages - 1));
+    }
+
+    void* pa = mem::pmm::palloc(npages);
+    if (pa == nullptr) return nullptr;
+
+    page* p = mem::pmm::phys_to_page((uint64_t)pa);
+    p->flags |= PG_LARGE;
+    p->inuse = (uint32_t)npages;
+    return (void*)mem::vmm::pa_to_va((uint64_t)pa);
+}
+
+static size_t usable_size(page* p) {
+    if (p->flags & PG_SLAB) return ((slab_cache*)p->slab_cache)->size;
+    return (size_t)p->inuse * PAGE_SIZE;
+}
+
+namespace mem::heap {
+
+void initialise() {
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        caches[i].size = 1UL << (i + MIN_CLASS_SHIFT);
+        caches[i].objects_per_slab = PAGE_SIZE / caches[i].size;
+        caches[i].partial = nullptr;
+        caches[i].empty = nullptr;
+        caches[i].lock.locked = false;
+    }
+
+    for (int i = 0; i < ARENA_BINS; i++) arena_bins[i] = nullptr;
+    arena_bin_mask = 0;
+    arena_lock.locked = false;
+
+    mem::vmm::reserve_kernel_range((void*)KHEAP_BASE, KHEAP_SIZE / PAGE_SIZE);
+}
+
+void* malloc(size_t n) {
+    return malloc_tagged(n, __builtin_return_address(0));
+}
+
+void* malloc_tagged(size_t n, void* site) {
+    void* ptr;
+    if (n <= (1UL << MAX_CLASS_SHIFT)) {
+        ptr = slab_alloc(&caches[class_for(n)]);
+    } else if (n <= ARENA_MAX_ALLOC) {
+        ptr = arena_alloc(n);
+    } else {
+        ptr = large_alloc(n, PAGE_SIZE);
+    }
+
+    if (ptr == nullptr) {
+        Log::errf("Malloc: Failed to allocate %zu bytes", n);
+    }
+#ifdef CONFIG_MEM_PROFILE
+    else mem::prof::record_alloc(MEMPROF_HEAP, ptr, n, site);
+#else
+    (void)site;
+#endif
+    return ptr;
+}
+
+void* malloc_aligned(size_t n, size_t alignment) {
+    if ((alignment & (alignment - 1)) != 0) return nullptr;
+
+    // Slab objects are aligned to their class size
+    size_t class_size = n > alignment ? n : alignment;
+    void* ptr;
+    if (class_size <= (1UL << MAX_CLASS_SHIFT)) {
+        ptr = slab_alloc(&caches[class_for(class_size)]);
+    } else if (alignment <= ARENA_ALIGN && n <= ARENA_MAX_ALLOC) {
+        ptr = arena_alloc(n);
+    } else {
+        ptr = large_alloc(n, alignment);
+    }
+
+    if (ptr == nullptr) {
+        Log::errf("malloc_aligned: Failed to allocate %zu bytes", n);
+    }
+#ifdef CONFIG_MEM_PROFILE
+    else mem::prof::record_alloc(MEMPROF_HEAP, ptr, n, __builtin_return_address(0));
+#endif
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t n) {
+    void* site = __builtin_return_address(0);
+    if (ptr == nullptr) {
+        return malloc_tagged(n, site);
+    }
+
+    if (n == 0) {
+        free(ptr);
+        return nullptr;
+    }
+
+    size_t old_size;
+    if (is_arena(ptr)) {
+        old_size = block_usable(payload_block(ptr));
+        if (old_size < n && n <= ARENA_MAX_ALLOC && arena_resize(payload_block(ptr), n)) {
+            old_size = n;
+        }
+    } else {
+        page* p = owner_page(ptr);
+        if (p == nullptr || !(p->flags & (PG_SLAB | PG_LARGE))) {
+            Log::errf("Realloc: Failed to find memory block for %p", ptr);
+            return nullptr;
+        }
+        old_size = usable_size(p);
+    }
+
+    if (old_size >= n) {
+#ifdef CONFIG_MEM_PROFILE
+        mem::prof::record_free(MEMPROF_HEAP, ptr);
+        mem::prof::record_alloc(MEMPROF_HEAP, ptr, n, site);
+#endif
+        return ptr;
+    }
+
+    void* new_ptr = malloc_tagged(n, site);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size);
+        free(ptr);
+        return new_ptr;
+    }
+
+    Log::errf("Realloc: Failed to allocate %zu bytes", n);
+    return nullptr;
+}
+
+void* calloc(size_t n, size_t size) {
+    size_t total_size = n * size;
+
+    void* ptr = malloc_tagged(total_size, __builtin_return_address(0));
+    if (ptr) {
+        memset(ptr, 0, total_size);
+    }
+
+    return ptr;
+}
+
+void free(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+
+#ifdef CONFIG_MEM_PROFILE
+    mem::prof::record_free(MEMPROF_HEAP, ptr);
+#endif
+
+    if (is_arena(ptr)) {
+        arena_free(ptr);
+        return;
+    }
+
+    page* p = owner_page(ptr);
+    if (p != nullptr && (p->flags & PG_SLAB)) {
+        slab_free(p, ptr);
+        return;
+    }
+
+    if (p != nullptr && (p->flags & PG_LARGE) && ((uint64_t)ptr & (PAGE_SIZE - 1)) == 0) {
+        size_t npages = p->inuse;
+        p->flags &= ~PG_LARGE;
+        p->inuse = 0;
+        mem::pmm::free(ptr, npages);
+        return;
+    }
+
+    Log::errf("Free: Attempted to free a block that wasn't allocated: %p", ptr);
+}
+
+}
+
+#ifdef CONFIG_HEAP_BENCH
+// Times free() against a growing number of live allocations, once for a
+// slab size class and once for arena-sized blocks. Both should stay flat.
+static uint64_t bench_free(void** slots, int live, size_t min_size, size_t spread) {
+    uint32_t seed = 0x2545F491;
+    for (int i = 0; i < live; i++) {
+        seed = seed * 1103515245 + 12345;
+        slots[i] = mem::heap::malloc(min_size + (seed >> 8) % spread);
+    }
+
+    // Free in a scattered order so neighbours are a mix of used and free
+    uint64_t cycles = 0;
+    int freed = 0;
+    for (int stride = 0; stride < 7; stride++) {
+        for (int i = stride; i < live; i += 7) {
+            if (slots[i] == nullptr) continue;
+            uint64_t start = arch::x86_64::cpu::rdtsc();
+            mem::heap::free(slots[i]);
+            cycles += arch::x86_64::cpu::rdtsc() - start;
+            freed++;
+        }
+    }
+
+    return freed ? cycles / freed : 0;
+}
+
+namespace mem::heap {
+
+void benchmark() {
+    const int max_live = 4096;
+    const size_t slot_pages = max_live * sizeof(void*) / PAGE_SIZE;
+
+    void* slots_pa = mem::pmm::palloc(slot_pages);
+    if (slots_pa == nullptr) {
+        Log::errf("Heap bench: failed to allocate slot table");
+        return;
+    }
+    void** slots = (void**)mem::vmm::pa_to_va((uint64_t)slots_pa);
+
+    for (int live = 64; live <= max_live; live *= 4) {
+        uint64_t small = bench_free(slots, live, 24, 200);
+        uint64_t large = bench_free(slots, live, 4200, 4000);
+        Log::infof("Heap bench: live=%d free avg %llu cycles (slab), %llu cycles (arena)",
+                   live, small, large);
+    }
+
+    mem::pmm::free(slots, slot_pages);
+}
+
+}
+#endif
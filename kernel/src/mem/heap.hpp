@@ -5,11 +5,14 @@ namespace mem::heap {
 	void initialise();
 
     void* malloc(size_t n);
+	void* malloc_tagged(size_t n, void* site);
 	void* malloc_aligned(size_t n, size_t alignment);
 	void* realloc(void* ptr, size_t n);
 	void* calloc(size_t n, size_t size);
 
 	void free(void* ptr);
+
+	void benchmark();
 }
 
 #endif /* HEAP_HPP */
\ No newline at end of file
@@ -31,7 +31,7 @@ namespace mem {
 		void* valloc(size_t npages);
 		void free(void* ptr, size_t npages);
 		uint64_t mmap(void* paddr, void* vaddr, size_t npages, uint64_t attributes);
-		void munmap(void* vaddr, size_t npages);
+		bool munmap(void* vaddr, size_t npages);
 
 		void* create_pagetable();
 		void destroy_pagetable(void* pml4_ptr);
@@ -42,13 +42,12 @@ namespace mem {
 		void initialise();
 
 		void* malloc(size_t n);
+		void* malloc_tagged(size_t n, void* site); // site is the caller charged by the memory profiler
 		void* malloc_aligned(size_t n, size_t alignment); // preffered to use vmm::valloc instead
 		void* realloc(void* ptr, size_t n);
 		void* calloc(size_t n, size_t size);
 
 		void free(void* ptr);
-
-		void* reserve_heap(size_t npages);
 	}
 
 	void* memset(void* dest, int value, size_t count);
@@ -0,0 +1,208 @@
+#include <mem/mem.hpp>
+#include <mem/memprof.hpp>
+#include <sync/spinlock.hpp>
+#include <devfs/devfs.hpp>
+#include <config.hpp>
+#include <cstdio>
+
+#ifdef CONFIG_MEM_PROFILE
+
+#define PROF_SITES		512
+#define PROF_TAGS		(1 << 14)
+#define PROF_REPORT_MAX	32
+
+// Per call-site totals. Sites are return addresses into the caller of
+// malloc/palloc; resolve them with addr2line against the kernel ELF.
+struct prof_site {
+	void* site;
+	int kind;
+	uint64_t live_bytes;
+	uint64_t live_count;
+	uint64_t allocs;
+	uint64_t peak_bytes;
+};
+
+// Live allocation -> owning site. The key is the pointer with the kind in
+// bit 0, heap pointers and frames are both at least 2-byte aligned.
+struct prof_tag {
+	uint64_t key;
+	uint64_t size;
+	uint32_t site;
+};
+
+static prof_site sites[PROF_SITES];
+static prof_tag tags[PROF_TAGS];
+static uint64_t dropped;
+static sync::spinlock prof_lock;
+
+static inline uint64_t hash(uint64_t key, uint64_t size) {
+	return (key * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+}
+
+static int site_index(void* site, int kind) {
+	uint64_t i = hash((uint64_t)site | kind, PROF_SITES);
+	for (int n = 0; n < PROF_SITES; n++, i = (i + 1) & (PROF_SITES - 1)) {
+		if (sites[i].allocs == 0) {
+			sites[i].site = site;
+			sites[i].kind = kind;
+			return i;
+		}
+		if (sites[i].site == site && sites[i].kind == kind) return i;
+	}
+	return -1;
+}
+
+static prof_tag* tag_find(uint64_t key) {
+	uint64_t i = hash(key, PROF_TAGS);
+	for (int n = 0; n < PROF_TAGS; n++, i = (i + 1) & (PROF_TAGS - 1)) {
+		if (tags[i].key == 0) return nullptr;
+		if (tags[i].key == key) return &tags[i];
+	}
+	return nullptr;
+}
+
+static prof_tag* tag_insert(uint64_t key) {
+	uint64_t i = hash(key, PROF_TAGS);
+	for (int n = 0; n < PROF_TAGS; n++, i = (i + 1) & (PROF_TAGS - 1)) {
+		if (tags[i].key == 0 || tags[i].key == key) {
+			tags[i].key = key;
+			return &tags[i];
+		}
+	}
+	return nullptr;
+}
+
+// Linear probing delete: shift later entries of the same cluster back
+static void tag_remove(prof_tag* t) {
+	uint64_t hole = t - tags;
+	uint64_t i = hole;
+	while (true) {
+		i = (i + 1) & (PROF_TAGS - 1);
+		if (tags[i].key == 0) break;
+
+		uint64_t home = hash(tags[i].key, PROF_TAGS);
+		if (((i - home) & (PROF_TAGS - 1)) >= ((i - hole) & (PROF_TAGS - 1))) {
+			tags[hole] = tags[i];
+			hole = i;
+		}
+	}
+	tags[hole].key = 0;
+}
+
+namespace mem::prof {
+
+void record_alloc(int kind, void* ptr, size_t size, void* site) {
+	uint64_t key = (uint64_t)ptr | kind;
+	uint64_t flags = sync::lock_irqsave(&prof_lock);
+
+	int s = site_index(site, kind);
+	prof_tag* t = s < 0 ? nullptr : tag_insert(key);
+	if (t == nullptr) {
+		dropped++;
+		sync::unlock_irqrestore(&prof_lock, flags);
+		return;
+	}
+
+	t->size = size;
+	t->site = s;
+
+	prof_site* ps = &sites[s];
+	ps->live_bytes += size;
+	ps->live_count++;
+	ps->allocs++;
+	if (ps->live_bytes > ps->peak_bytes) ps->peak_bytes = ps->live_bytes;
+
+	sync::unlock_irqrestore(&prof_lock, flags);
+}
+
+void record_free(int kind, void* ptr) {
+	uint64_t key = (uint64_t)ptr | kind;
+	uint64_t flags = sync::lock_irqsave(&prof_lock);
+
+	prof_tag* t = tag_find(key);
+	if (t) {
+		prof_site* ps = &sites[t->site];
+		ps->live_bytes -= t->size;
+		ps->live_count--;
+		tag_remove(t);
+	}
+
+	sync::unlock_irqrestore(&prof_lock, flags);
+}
+
+// Fills `order` with the used site indices, largest live footprint first
+static int sorted_sites(uint16_t* order) {
+	int count = 0;
+	for (int i = 0; i < PROF_SITES; i++) {
+		if (sites[i].allocs == 0) continue;
+
+		int j = count++;
+		while (j > 0 && sites[order[j - 1]].live_bytes < sites[i].live_bytes) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+	return count;
+}
+
+static size_t format_site(char* buf, size_t size, prof_site* ps) {
+	int len = snprintf(buf, size, "%s %p live=%llu (%llu objs) peak=%llu allocs=%llu",
+		ps->kind == MEMPROF_PMM ? "pmm " : "heap", ps->site,
+		ps->live_bytes, ps->live_count, ps->peak_bytes, ps->allocs);
+	return len < (int)size ? len : size - 1;
+}
+
+void report() {
+	uint16_t order[PROF_SITES];
+	uint64_t flags = sync::lock_irqsave(&prof_lock);
+	int count = sorted_sites(order);
+	sync::unlock_irqrestore(&prof_lock, flags);
+
+	Log::infof("memprof: %d call sites, %llu untracked allocations", count, dropped);
+	for (int i = 0; i < count && i < PROF_REPORT_MAX; i++) {
+		char line[128];
+		format_site(line, sizeof(line), &sites[order[i]]);
+		Log::infof("memprof: %s", line);
+	}
+}
+
+// The report is rebuilt on every read, so a reader that takes it in
+// several pieces may see the totals move between them
+static ssize_t memstat_read(void* ctx, void* buf, size_t count, off_t offset) {
+	uint16_t order[PROF_SITES];
+	const size_t line_max = 128;
+
+	uint64_t flags = sync::lock_irqsave(&prof_lock);
+	int nsites = sorted_sites(order);
+	sync::unlock_irqrestore(&prof_lock, flags);
+
+	char* report = (char*)mem::heap::malloc(nsites * line_max + 1);
+	if (!report) {
+		Log::errf("memprof: Failed to allocate report buffer");
+		return -1;
+	}
+
+	size_t len = 0;
+	for (int i = 0; i < nsites; i++) {
+		len += format_site(report + len, line_max - 1, &sites[order[i]]);
+		report[len++] = '\n';
+	}
+
+	if (offset < 0 || (size_t)offset >= len) count = 0;
+	else if (count > len - offset) count = len - offset;
+	if (count) mem::memcpy(buf, report + offset, count);
+
+	mem::heap::free(report);
+	return count;
+}
+
+static const devfs::device_ops memstat_ops = { .read = memstat_read };
+
+void initialise() {
+	devfs::register_device("memstat", &memstat_ops, nullptr, 0444);
+}
+
+}
+
+#endif
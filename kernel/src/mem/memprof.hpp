@@ -0,0 +1,21 @@
+#ifndef MEMPROF_HPP
+#define MEMPROF_HPP 1
+
+#include <cstdint>
+#include <cstddef>
+
+#define MEMPROF_HEAP	0
+#define MEMPROF_PMM		1
+
+namespace mem::prof {
+
+void record_alloc(int kind, void* ptr, size_t size, void* site);
+void record_free(int kind, void* ptr);
+
+void report();
+// Registers /dev/memstat, which formats the current per-site totals on each read
+void initialise();
+
+}
+
+#endif /* MEMPROF_HPP */
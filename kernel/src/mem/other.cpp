@@ -1,23 +1,104 @@
 #include <mem/mem.hpp>
 #include <cstddef>
 #include <cstdio>
+#include <arch/arch.hpp>
+#include <config.hpp>
+
+using arch::x86_64::cpu::features;
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+static inline void copy_forward(unsigned char* d, const unsigned char* s, size_t count) {
+    if (features.erms || features.fsrm) {
+        asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(count) :: "memory");
+        return;
+    }
+    size_t words = count >> 3, tail = count & 7;
+    asm volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) :: "memory");
+    asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(tail) :: "memory");
+}
+
+#ifdef CONFIG_MEM_AVX2
+// The compiler never allocates vector registers (-mno-sse), so the asm
+// below needs no clobbers for them once kernel_fpu_begin saved the state
+static bool avx2_copy(unsigned char* d, const unsigned char* s, size_t count) {
+    size_t blocks = count / 128;
+    if (!blocks || !arch::x86_64::cpu::fpu::kernel_fpu_begin()) return false;
+
+    asm volatile(
+        "1:\n"
+        "vmovdqu 0(%1), %%ymm0\n"
+        "vmovdqu 32(%1), %%ymm1\n"
+        "vmovdqu 64(%1), %%ymm2\n"
+        "vmovdqu 96(%1), %%ymm3\n"
+        "vmovdqu %%ymm0, 0(%0)\n"
+        "vmovdqu %%ymm1, 32(%0)\n"
+        "vmovdqu %%ymm2, 64(%0)\n"
+        "vmovdqu %%ymm3, 96(%0)\n"
+        "add $128, %0\n"
+        "add $128, %1\n"
+        "dec %2\n"
+        "jnz 1b\n"
+        : "+r"(d), "+r"(s), "+r"(blocks) :: "memory", "cc");
+
+    arch::x86_64::cpu::fpu::kernel_fpu_end();
+    copy_forward(d, s, count & 127);
+    return true;
+}
+
+static bool avx2_set(unsigned char* d, unsigned char value, size_t count) {
+    size_t blocks = count / 128;
+    if (!blocks || !arch::x86_64::cpu::fpu::kernel_fpu_begin()) return false;
+
+    uint32_t pattern = value * 0x01010101U;
+    asm volatile(
+        "vmovd %k2, %%xmm0\n"
+        "vpbroadcastd %%xmm0, %%ymm0\n"
+        "1:\n"
+        "vmovdqu %%ymm0, 0(%0)\n"
+        "vmovdqu %%ymm0, 32(%0)\n"
+        "vmovdqu %%ymm0, 64(%0)\n"
+        "vmovdqu %%ymm0, 96(%0)\n"
+        "add $128, %0\n"
+        "dec %1\n"
+        "jnz 1b\n"
+        : "+r"(d), "+r"(blocks) : "r"(pattern) : "memory", "cc");
+
+    arch::x86_64::cpu::fpu::kernel_fpu_end();
+    size_t tail = count & 127;
+    asm volatile("rep stosb" : "+D"(d), "+c"(tail) : "a"(value) : "memory");
+    return true;
+}
+#endif
 
 extern "C" {
 
 void* memset(void* dest, int value, size_t count) {
     unsigned char* d = static_cast<unsigned char*>(dest);
-    for (size_t i = 0; i < count; i++) {
-        d[i] = static_cast<unsigned char>(value);
+#ifdef CONFIG_MEM_AVX2
+    if (count >= CONFIG_MEM_AVX2_THRESHOLD && features.avx2 &&
+        avx2_set(d, static_cast<unsigned char>(value), count))
+        return dest;
+#endif
+    if (features.erms || features.fsrm) {
+        asm volatile("rep stosb" : "+D"(d), "+c"(count) : "a"(value) : "memory");
+        return dest;
     }
+    uint64_t pattern = static_cast<unsigned char>(value) * 0x0101010101010101ULL;
+    size_t words = count >> 3, tail = count & 7;
+    asm volatile("rep stosq" : "+D"(d), "+c"(words) : "a"(pattern) : "memory");
+    asm volatile("rep stosb" : "+D"(d), "+c"(tail) : "a"(pattern) : "memory");
     return dest;
 }
 
 void* memcpy(void* dest, const void* src, size_t count) {
-    const unsigned char* s = static_cast<const unsigned char*>(src);
     unsigned char* d = static_cast<unsigned char*>(dest);
-    for (size_t i = 0; i < count; i++) {
-        d[i] = s[i];
-    }
+    const unsigned char* s = static_cast<const unsigned char*>(src);
+#ifdef CONFIG_MEM_AVX2
+    if (count >= CONFIG_MEM_AVX2_THRESHOLD && features.avx2 && avx2_copy(d, s, count))
+        return dest;
+#endif
+    copy_forward(d, s, count);
     return dest;
 }
 
@@ -28,14 +109,20 @@ void* memmove(void* dest, const void* src, size_t count) {
     if (d == s || count == 0)
         return dest;
 
-    if (d < s) {
-        for (size_t i = 0; i < count; i++) {
-            d[i] = s[i];
-        }
-    } else {
-        for (size_t i = count; i > 0; i--) {
-            d[i - 1] = s[i - 1];
-        }
+    // A forward copy never reads a byte it already overwrote when d < s
+    if (d < s || d >= s + count)
+        return memcpy(dest, src, count);
+
+    // Backwards rep movs is slow and would need DF set with interrupts
+    // on, so copy words from the end instead
+    size_t i = count;
+    while (i >= 8) {
+        i -= 8;
+        *reinterpret_cast<unaligned_u64*>(d + i) = *reinterpret_cast<const unaligned_u64*>(s + i);
+    }
+    while (i > 0) {
+        i--;
+        d[i] = s[i];
     }
 
     return dest;
@@ -44,7 +131,16 @@ void* memmove(void* dest, const void* src, size_t count) {
 int memcmp(const void* ptr1, const void* ptr2, size_t count) {
     const unsigned char* a = static_cast<const unsigned char*>(ptr1);
     const unsigned char* b = static_cast<const unsigned char*>(ptr2);
-    for (size_t i = 0; i < count; i++) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint64_t x = *reinterpret_cast<const unaligned_u64*>(a + i);
+        uint64_t y = *reinterpret_cast<const unaligned_u64*>(b + i);
+        if (x != y) {
+            i += __builtin_ctzll(x ^ y) / 8;
+            return (a[i] < b[i]) ? -1 : 1;
+        }
+    }
+    for (; i < count; i++) {
         if (a[i] != b[i])
             return (a[i] < b[i]) ? -1 : 1;
     }
@@ -76,7 +172,7 @@ int memcmp(const void* ptr1, const void* ptr2, size_t count) {
 #include <panic.hpp>
 
 void* operator new(size_t size) {
-    void* ptr = mem::heap::malloc(size);
+    void* ptr = mem::heap::malloc_tagged(size, __builtin_return_address(0));
     if (!ptr) panic((char*)"K_OUT_OF_MEM");
     return ptr;
 }
@@ -86,7 +182,7 @@ void operator delete(void* ptr) {
 }
 
 void* operator new[](size_t size) {
-    void* ptr = mem::heap::malloc(size);
+    void* ptr = mem::heap::malloc_tagged(size, __builtin_return_address(0));
     if (!ptr) panic((char*)"K_OUT_OF_MEM");
     return ptr;
 }
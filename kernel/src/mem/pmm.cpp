@@ -1,5 +1,9 @@
 #include <mem/mem.hpp>
 #include <cstdio>
+#include <config.hpp>
+#include <arch/arch.hpp>
+#include <sync/spinlock.hpp>
+#include <mem/memprof.hpp>
 #include <limine.h>
 
 __attribute__((section(".limine_requests")))
@@ -10,20 +14,53 @@ volatile limine_memmap_request memmap_request = {
 };
 
 #define PAGE_SIZE 4096
-#define MAX_SEGMENTS 8
 #define MIN_ALLOC_ADDR 0x100000
 
-struct segment {
-	uint64_t base;
-	uint64_t length;
-	bool is_bitmap;
-	uint64_t remaining_bytes;
+// Largest buddy block is 2^MAX_ORDER pages (4 GiB)
+#define MAX_ORDER 20
+
+#define PCP_HIGH CONFIG_PMM_PCP_HIGH
+#define PCP_BATCH CONFIG_PMM_PCP_BATCH
+#define ZERO_POOL_SIZE CONFIG_PMM_ZERO_POOL
+
+using mem::pmm::page;
+
+struct free_area {
+	page* head;
+	uint64_t count;
+};
+
+static free_area free_areas[MAX_ORDER + 1];
+static sync::spinlock zone_lock;
+
+// Per-CPU magazine of hot order-0 frames, linked through their descriptors
+struct per_cpu_pages {
+	page* head;
+	page* tail;
+	uint64_t count;
+
+	uint64_t alloc_hits;
+	uint64_t refills;
+	uint64_t free_hits;
+	uint64_t drains;
 };
 
-static segment segments[MAX_SEGMENTS];
-static uint8_t* bitmap = nullptr;
-static uint64_t bitmap_size = 0;
-static uint64_t total_pages = 0;
+static per_cpu_pages pcps[CONFIG_MAX_CPUS];
+
+// Frames zeroed while the CPU is idle, linked through their descriptors.
+// Lock order is zone_lock, then zero_lock.
+static page* zero_pool = nullptr;
+static uint64_t zero_pool_count = 0;
+static sync::spinlock zero_lock;
+
+// Shared read-only frame of zeroes, holds one reference of its own so it
+// is never freed
+static uint64_t zero_page_pa = 0;
+
+// Flat descriptor array covering every frame between the lowest and highest usable PFN
+static page* mem_map = nullptr;
+static uint64_t pfn_base = 0;
+static uint64_t pfn_end = 0;
 
 uint64_t total_addrspace;
 uint64_t total_mem;
@@ -33,10 +70,11 @@ uint64_t allocation_count;
 uint64_t failed_allocation_count;
 uint64_t free_count;
 uint64_t failed_free_count;
+uint64_t zero_pool_hits;
+uint64_t zero_pool_misses;
 
-inline void bitmap_set(uint64_t index) { bitmap[index / 8] |= (1 << (index % 8)); }
-inline void bitmap_clear(uint64_t index) { bitmap[index / 8] &= ~(1 << (index % 8)); }
-inline bool bitmap_test(uint64_t index) { return bitmap[index / 8] & (1 << (index % 8)); }
+#define STAT_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(var, n) __atomic_sub_fetch(&(var), (n), __ATOMIC_RELAXED)
 
 static inline void membulkset(void* ptr, uint64_t value, size_t bytes) {
     uint8_t* p = (uint8_t*)ptr;
@@ -58,24 +96,197 @@ static inline void membulkset(void* ptr, uint64_t value, size_t bytes) {
     }
 }
 
-static void prepare_bitmap(uint64_t mem) {
-	bitmap_size = mem / 8;
+static inline page* pfn_page(uint64_t pfn) { return &mem_map[pfn - pfn_base]; }
+static inline uint64_t page_pfn(page* p) { return pfn_base + (p - mem_map); }
+
+static void free_area_push(page* p, int order) {
+	free_area* area = &free_areas[order];
+
+	p->prev = nullptr;
+	p->next = area->head;
+	if (area->head) area->head->prev = p;
+	area->head = p;
+	area->count++;
+
+	p->flags |= PG_BUDDY;
+	p->order = order;
+}
+
+static void free_area_remove(page* p, int order) {
+	free_area* area = &free_areas[order];
+
+	if (p->prev) p->prev->next = p->next;
+	else area->head = p->next;
+	if (p->next) p->next->prev = p->prev;
+	area->count--;
+
+	p->flags &= ~PG_BUDDY;
+	p->next = p->prev = nullptr;
+}
+
+static void free_block_coalesce(uint64_t pfn, int order) {
+	while (order < MAX_ORDER) {
+		uint64_t buddy = pfn ^ (1ULL << order);
+		if (buddy < pfn_base || buddy >= pfn_end) break;
+
+		page* b = pfn_page(buddy);
+		if (!(b->flags & PG_BUDDY) || b->order != order) break;
+
+		free_area_remove(b, order);
+		if (buddy < pfn) pfn = buddy;
+		order++;
+	}
+
+	free_area_push(pfn_page(pfn), order);
+}
+
+// Hands [pfn, pfn + npages) back as the largest naturally aligned blocks
+static void free_range(uint64_t pfn, uint64_t npages) {
+	while (npages) {
+		int order = 0;
+		while (order < MAX_ORDER
+			&& !(pfn & ((1ULL << (order + 1)) - 1))
+			&& (1ULL << (order + 1)) <= npages)
+			order++;
+
+		free_block_coalesce(pfn, order);
+		pfn += 1ULL << order;
+		npages -= 1ULL << order;
+	}
+}
+
+static int order_for(uint64_t npages) {
+	int order = 0;
+	while ((1ULL << order) < npages) order++;
+	return order;
+}
+
+static page* alloc_block(int order) {
+	int found = order;
+	while (found <= MAX_ORDER && !free_areas[found].head) found++;
+	if (found > MAX_ORDER) return nullptr;
+
+	page* p = free_areas[found].head;
+	free_area_remove(p, found);
+
+	uint64_t pfn = page_pfn(p);
+	while (found > order) {
+		found--;
+		free_area_push(pfn_page(pfn + (1ULL << found)), found);
+	}
+
+	return p;
+}
+
+static inline bool usable_range(limine_memmap_entry* e, uint64_t* first, uint64_t* last) {
+	if (e->type != LIMINE_MEMMAP_USABLE) return false;
+
+	uint64_t base = (e->base < MIN_ALLOC_ADDR) ? MIN_ALLOC_ADDR : e->base;
+	uint64_t end = e->base + e->length;
+	*first = (base + PAGE_SIZE - 1) / PAGE_SIZE;
+	*last = end / PAGE_SIZE;
+	return *last > *first;
+}
+
+static bool prepare_mem_map() {
+	uint64_t map_len = ((pfn_end - pfn_base) * sizeof(page) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+	uint64_t map_pages = map_len / PAGE_SIZE;
 
-	segment* best = nullptr;
-	for (int i = 0; i < MAX_SEGMENTS; i++) {
-		if (!segments[i].is_bitmap && segments[i].length >= bitmap_size) {
-			if (!best || segments[i].length < best->length)
-				best = &segments[i];
+	limine_memmap_entry* best = nullptr;
+	uint64_t best_first = 0, best_pages = 0;
+	for (uint64_t i = 0; i < memmap_request.response->entry_count; i++) {
+		uint64_t first, last;
+		if (!usable_range(memmap_request.response->entries[i], &first, &last)) continue;
+		if (last - first < map_pages) continue;
+
+		if (!best || last - first < best_pages) {
+			best = memmap_request.response->entries[i];
+			best_first = first;
+			best_pages = last - first;
 		}
 	}
 
 	if (!best) {
-		return;
+		return false;
+	}
+
+	mem_map = reinterpret_cast<page*>(mem::vmm::pa_to_va(best_first * PAGE_SIZE));
+	membulkset(mem_map, 0, map_len);
+
+	for (uint64_t pfn = pfn_base; pfn < pfn_end; pfn++) {
+		pfn_page(pfn)->flags = PG_RESERVED;
 	}
 
-	best->is_bitmap = true;
-	bitmap = reinterpret_cast<uint8_t*>(best->base);
-	membulkset(bitmap, 0, bitmap_size);
+	for (uint64_t i = 0; i < memmap_request.response->entry_count; i++) {
+		uint64_t first, last;
+		if (!usable_range(memmap_request.response->entries[i], &first, &last)) continue;
+
+		if (memmap_request.response->entries[i] == best) first += map_pages;
+		for (uint64_t pfn = first; pfn < last; pfn++) {
+			pfn_page(pfn)->flags = 0;
+		}
+		if (last > first) free_range(first, last - first);
+	}
+
+	used_mem += map_len;
+	free_mem -= map_len;
+	return true;
+}
+
+static uint64_t pcp_stat(uint64_t per_cpu_pages::* field) {
+	uint64_t sum = 0;
+	for (int i = 0; i < CONFIG_MAX_CPUS; i++) sum += pcps[i].*field;
+	return sum;
+}
+
+static void pcp_push(per_cpu_pages* pcp, page* p) {
+	p->prev = nullptr;
+	p->next = pcp->head;
+	if (pcp->head) pcp->head->prev = p;
+	else pcp->tail = p;
+	pcp->head = p;
+	pcp->count++;
+	p->flags |= PG_PCP;
+}
+
+static page* pcp_pop_head(per_cpu_pages* pcp) {
+	page* p = pcp->head;
+	pcp->head = p->next;
+	if (pcp->head) pcp->head->prev = nullptr;
+	else pcp->tail = nullptr;
+	pcp->count--;
+	p->flags &= ~PG_PCP;
+	p->next = p->prev = nullptr;
+	return p;
+}
+
+static page* pcp_pop_tail(per_cpu_pages* pcp) {
+	page* p = pcp->tail;
+	pcp->tail = p->prev;
+	if (pcp->tail) pcp->tail->next = nullptr;
+	else pcp->head = nullptr;
+	pcp->count--;
+	p->flags &= ~PG_PCP;
+	p->next = p->prev = nullptr;
+	return p;
+}
+
+// Caller holds zone_lock
+static void pcp_refill(per_cpu_pages* pcp) {
+	for (int i = 0; i < PCP_BATCH; i++) {
+		page* p = alloc_block(0);
+		if (!p) break;
+		pcp_push(pcp, p);
+	}
+	pcp->refills++;
+}
+
+// Caller holds zone_lock, hands the coldest frames back to the buddy lists
+static void pcp_drain(per_cpu_pages* pcp, uint64_t count) {
+	while (count-- && pcp->count) {
+		free_block_coalesce(page_pfn(pcp_pop_tail(pcp)), 0);
+	}
+	pcp->drains++;
 }
 
 namespace mem::pmm {
@@ -93,14 +304,52 @@ uint64_t stat_get_status(uint8_t type) {
 		case 4: return failed_allocation_count;
 		case 5: return free_count;
 		case 6: return failed_free_count;
+		case 7: return pcp_stat(&per_cpu_pages::alloc_hits);
+		case 8: return pcp_stat(&per_cpu_pages::refills);
+		case 9: return pcp_stat(&per_cpu_pages::free_hits);
+		case 10: return pcp_stat(&per_cpu_pages::drains);
+		case 11: return zero_pool_hits;
+		case 12: return zero_pool_misses;
 		default: return 0xBADBADBADBADBAD0;
 	}
 }
 
 void stat_print() {
 	Log::infof("PMM: total=%llu used=%llu free=%llu", total_mem, used_mem, free_mem);
+	Log::infof("PMM: pcp alloc hits=%llu refills=%llu, free hits=%llu drains=%llu",
+		pcp_stat(&per_cpu_pages::alloc_hits), pcp_stat(&per_cpu_pages::refills),
+		pcp_stat(&per_cpu_pages::free_hits), pcp_stat(&per_cpu_pages::drains));
+	Log::infof("PMM: zero pool=%llu, hits=%llu misses=%llu",
+		zero_pool_count, zero_pool_hits, zero_pool_misses);
+}
+
+page* pfn_to_page(uint64_t pfn) {
+	if (!mem_map || pfn < pfn_base || pfn >= pfn_end) return nullptr;
+	return pfn_page(pfn);
+}
+
+page* phys_to_page(uint64_t pa) {
+	return pfn_to_page(mem::vmm::va_to_pa(pa) / PAGE_SIZE);
+}
+
+uint64_t page_to_phys(page* p) {
+	return page_pfn(p) * PAGE_SIZE;
+}
+
+void page_get(uint64_t pa) {
+	page* p = phys_to_page(pa);
+	if (p) __atomic_add_fetch(&p->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void page_put(uint64_t pa) {
+	page* p = phys_to_page(pa);
+	if (p && __atomic_sub_fetch(&p->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free((void*)(pa & ~(uint64_t)(PAGE_SIZE - 1)), 1);
+	}
 }
 
+static void* palloc_pages(size_t npages);
+
 void initialise() {
 	if (!memmap_request.response || memmap_request.response->entry_count < 1) {
 		Log::errf("PMM: Failed to obtain memory map");
@@ -111,193 +360,339 @@ void initialise() {
 	allocation_count = failed_allocation_count = 0;
 	free_count = failed_free_count = 0;
 	total_addrspace = 0;
-
-	int created_segments = 0;
+	pfn_base = (uint64_t)-1;
+	pfn_end = 0;
 
 	for (uint64_t i = 0; i < memmap_request.response->entry_count; i++) {
 		limine_memmap_entry* e = memmap_request.response->entries[i];
 		total_addrspace += e->length;
 
-		if (e->type != LIMINE_MEMMAP_USABLE || created_segments >= MAX_SEGMENTS)
-			continue;
-
-		uint64_t seg_base = (e->base < MIN_ALLOC_ADDR) ? MIN_ALLOC_ADDR : e->base;
-		uint64_t seg_len  = (e->base < MIN_ALLOC_ADDR) 
-							? (e->length > (MIN_ALLOC_ADDR - e->base) ? e->length - (MIN_ALLOC_ADDR - e->base) : 0) 
-							: e->length;
-		if (seg_len == 0) continue;
+		uint64_t first, last;
+		if (!usable_range(e, &first, &last)) continue;
 
-		segment* s = &segments[created_segments++];
-		s->base = seg_base;
-		s->length = seg_len;
-		s->is_bitmap = false;
-		s->remaining_bytes = seg_len;
+		if (first < pfn_base) pfn_base = first;
+		if (last > pfn_end) pfn_end = last;
+		total_mem += (last - first) * PAGE_SIZE;
+	}
 
-		total_mem += seg_len;
+	if (pfn_end == 0) {
+		Log::errf("PMM: No usable memory in the memory map");
+		return;
 	}
 
-	prepare_bitmap(total_mem);
-	total_pages = total_mem / PAGE_SIZE;
 	free_mem = total_mem;
+	if (!prepare_mem_map()) {
+		Log::errf("PMM: No usable entry large enough for the page descriptors");
+		mem_map = nullptr;
+		return;
+	}
+
+	zero_page_pa = (uint64_t)palloc_pages(1);
+	if (zero_page_pa) {
+		membulkset((void*)mem::vmm::pa_to_va(zero_page_pa), 0, PAGE_SIZE);
+		pfn_page(zero_page_pa / PAGE_SIZE)->refcount = 1;
+	}
 }
 
-void* palloc(size_t npages) {
-	if (!bitmap || npages == 0) return nullptr;
+static void* palloc_single() {
+	uint64_t flags = sync::irq_save();
+	per_cpu_pages* pcp = &pcps[arch::x86_64::cpu::current_id()];
 
-	uint64_t needed = npages;
-	uint64_t page_offset = 0;
+	if (pcp->count) {
+		pcp->alloc_hits++;
+	} else {
+		sync::lock_irqsave(&zone_lock);
+		pcp_refill(pcp);
+		sync::unlock_irqrestore(&zone_lock, 0);
+	}
 
-	for (int segid = 0; segid < MAX_SEGMENTS; segid++) {
-		segment* seg = &segments[segid];
-		if (seg->length == 0 || seg->is_bitmap) continue;
+	page* p = pcp->count ? pcp_pop_head(pcp) : nullptr;
+	if (p) p->flags |= PG_ALLOCATED;
+	sync::irq_restore(flags);
 
-		if (seg->base + seg->length <= MIN_ALLOC_ADDR) {
-			page_offset += seg->length / PAGE_SIZE;
-			continue;
-		}
+	if (!p) return nullptr;
 
-		uint64_t seg_start_offset = 0;
-		if (seg->base < MIN_ALLOC_ADDR) {
-			seg_start_offset = (MIN_ALLOC_ADDR - seg->base) / PAGE_SIZE;
-		}
+	STAT_ADD(used_mem, PAGE_SIZE);
+	STAT_SUB(free_mem, PAGE_SIZE);
+	STAT_ADD(allocation_count, 1);
+	return reinterpret_cast<void*>(page_pfn(p) * PAGE_SIZE);
+}
 
-		uint64_t seg_pages = seg->length / PAGE_SIZE;
-		uint64_t found = 0;
-		uint64_t start = 0;
-
-		for (uint64_t j = seg_start_offset; j < seg_pages; j++) {
-			uint64_t global_index = page_offset + j;
-
-			if (!bitmap_test(global_index)) {
-				if (found == 0) start = j;
-				found++;
-				if (found == needed) {
-					uint64_t start_global = page_offset + start;
-					for (uint64_t k = 0; k < needed; k++) bitmap_set(start_global + k);
-
-					used_mem += needed * PAGE_SIZE;
-					free_mem -= needed * PAGE_SIZE;
-					seg->remaining_bytes -= needed * PAGE_SIZE;
-					allocation_count++;
-
-					return reinterpret_cast<void*>(seg->base + start * PAGE_SIZE);
-				}
-			} else {
-				found = 0;
-			}
-		}
+static void free_single(page* p) {
+	uint64_t flags = sync::irq_save();
+	per_cpu_pages* pcp = &pcps[arch::x86_64::cpu::current_id()];
 
-		page_offset += seg_pages;
+	if (!(p->flags & PG_ALLOCATED)) {
+		sync::irq_restore(flags);
+		STAT_ADD(failed_free_count, 1);
+		return;
 	}
 
-	failed_allocation_count++;
-	return nullptr;
+	p->flags &= ~PG_ALLOCATED;
+	pcp_push(pcp, p);
+
+	if (pcp->count > PCP_HIGH) {
+		sync::lock_irqsave(&zone_lock);
+		pcp_drain(pcp, PCP_BATCH);
+		sync::unlock_irqrestore(&zone_lock, 0);
+	} else {
+		pcp->free_hits++;
+	}
+	sync::irq_restore(flags);
+
+	STAT_SUB(used_mem, PAGE_SIZE);
+	STAT_ADD(free_mem, PAGE_SIZE);
+	STAT_ADD(free_count, 1);
 }
 
-void free(void* ptr, size_t npages) {
-	if (!bitmap || !ptr || npages == 0) return;
+// Caller holds zone_lock. Gives the pre-zeroed pool back when memory runs out.
+static void zero_pool_drain() {
+	sync::lock_irqsave(&zero_lock);
+	uint64_t drained = zero_pool_count;
+	while (zero_pool) {
+		page* p = zero_pool;
+		zero_pool = p->next;
+		p->flags &= ~(PG_ALLOCATED | PG_ZERO_POOL);
+		free_range(page_pfn(p), 1);
+	}
+	zero_pool_count = 0;
+	sync::unlock_irqrestore(&zero_lock, 0);
 
-	uint64_t addr = (uint64_t)mem::vmm::pa_to_va((uint64_t)ptr);
+	STAT_SUB(used_mem, drained * PAGE_SIZE);
+	STAT_ADD(free_mem, drained * PAGE_SIZE);
+}
 
-	if (addr < MIN_ALLOC_ADDR) {
-		Log::errf("PMM: Attempt to free memory below 1 MiB (%p)", ptr);
-		failed_free_count++;
-		return;
+// Caller holds zone_lock
+static page* buddy_alloc(size_t npages) {
+	int order = order_for(npages);
+	page* p = alloc_block(order);
+	if (!p) return nullptr;
+
+	uint64_t block_pages = 1ULL << order;
+	if (block_pages > npages) {
+		free_range(page_pfn(p) + npages, block_pages - npages);
 	}
 
-	uint64_t page_offset = 0;
-	segment* seg = nullptr;
-	int segid = -1;
+	for (uint64_t k = 0; k < npages; k++) p[k].flags |= PG_ALLOCATED;
+	return p;
+}
 
-	for (int i = 0; i < MAX_SEGMENTS; i++) {
-		if (segments[i].length == 0 || segments[i].is_bitmap) continue;
-		uint64_t seg_start = segments[i].base;
-		uint64_t seg_end = seg_start + segments[i].length;
+static void* palloc_pages(size_t npages) {
+	if (!mem_map || npages == 0) return nullptr;
 
-		if (addr >= seg_start && addr < seg_end) {
-			seg = &segments[i];
-			segid = i;
-			break;
-		}
+	if (npages > (1ULL << MAX_ORDER)) {
+		STAT_ADD(failed_allocation_count, 1);
+		return nullptr;
+	}
 
-		page_offset += segments[i].length / PAGE_SIZE;
+	if (npages == 1) {
+		void* ptr = palloc_single();
+		if (ptr) return ptr;
 	}
 
-	if (!seg) {
-		Log::errf("PMM: Free failed, pointer %p outside segments", ptr);
-		failed_free_count++;
-		return;
+	uint64_t flags = sync::lock_irqsave(&zone_lock);
+	page* p = buddy_alloc(npages);
+	if (!p) {
+		// Only the local magazine, other CPUs use theirs without zone_lock.
+		// Interrupts are off, so this CPU cannot change under us.
+		per_cpu_pages* pcp = &pcps[arch::x86_64::cpu::current_id()];
+		if (pcp->count) pcp_drain(pcp, pcp->count);
+		zero_pool_drain();
+		p = buddy_alloc(npages);
 	}
+	sync::unlock_irqrestore(&zone_lock, flags);
 
-	uint64_t seg_page_index = (addr - seg->base) / PAGE_SIZE;
-	uint64_t global_index = page_offset + seg_page_index;
-	uint64_t actually_freed = 0;
+	if (!p) {
+		STAT_ADD(failed_allocation_count, 1);
+		return nullptr;
+	}
 
-	for (uint64_t i = 0; i < npages; i++) {
-		if (bitmap_test(global_index + i)) {
-			bitmap_clear(global_index + i);
-			actually_freed += PAGE_SIZE;
-		} else {
-			failed_free_count++;
-		}
+	STAT_ADD(used_mem, npages * PAGE_SIZE);
+	STAT_SUB(free_mem, npages * PAGE_SIZE);
+	STAT_ADD(allocation_count, 1);
+
+	return reinterpret_cast<void*>(page_pfn(p) * PAGE_SIZE);
+}
+
+void* palloc(size_t npages) {
+	void* ptr = palloc_pages(npages);
+#ifdef CONFIG_MEM_PROFILE
+	if (ptr) mem::prof::record_alloc(MEMPROF_PMM, ptr, npages * PAGE_SIZE, __builtin_return_address(0));
+#endif
+	return ptr;
+}
+
+// Hands out a zeroed frame, from the pool when the idle loop has kept it
+// stocked and by zeroing one inline otherwise
+void* palloc_zeroed() {
+	uint64_t flags = sync::lock_irqsave(&zero_lock);
+	page* p = zero_pool;
+	if (p) {
+		zero_pool = p->next;
+		zero_pool_count--;
+		p->flags &= ~PG_ZERO_POOL;
+	}
+	sync::unlock_irqrestore(&zero_lock, flags);
+
+	void* ptr;
+	if (p) {
+		ptr = reinterpret_cast<void*>(page_pfn(p) * PAGE_SIZE);
+		STAT_ADD(zero_pool_hits, 1);
+	} else {
+		ptr = palloc_pages(1);
+		if (!ptr) return nullptr;
+		membulkset((void*)mem::vmm::pa_to_va((uint64_t)ptr), 0, PAGE_SIZE);
+		STAT_ADD(zero_pool_misses, 1);
 	}
 
-	if (used_mem >= actually_freed)
-		used_mem -= actually_freed;
-	else
-		used_mem = 0;
+#ifdef CONFIG_MEM_PROFILE
+	mem::prof::record_alloc(MEMPROF_PMM, ptr, PAGE_SIZE, __builtin_return_address(0));
+#endif
+	return ptr;
+}
 
-	free_mem += actually_freed;
-	seg->remaining_bytes += actually_freed;
-	free_count++;
+// Called when the CPU has nothing else to do. Tops the pre-zeroed pool up,
+// but leaves the last free memory to real allocations.
+void zero_pool_refill() {
+	while (__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) < ZERO_POOL_SIZE &&
+	       free_mem > 4 * ZERO_POOL_SIZE * PAGE_SIZE) {
+		void* ptr = palloc_pages(1);
+		if (!ptr) return;
+		membulkset((void*)mem::vmm::pa_to_va((uint64_t)ptr), 0, PAGE_SIZE);
+
+		page* p = pfn_page((uint64_t)ptr / PAGE_SIZE);
+		uint64_t flags = sync::lock_irqsave(&zero_lock);
+		p->flags |= PG_ZERO_POOL;
+		p->next = zero_pool;
+		zero_pool = p;
+		zero_pool_count++;
+		sync::unlock_irqrestore(&zero_lock, flags);
+	}
 }
 
-void* reserve_heap(size_t npages) {
-	if (!bitmap || npages == 0) return nullptr;
+uint64_t zero_page() {
+	return zero_page_pa;
+}
 
-	uint64_t needed = npages;
-	uint64_t page_offset = 0;
+void free(void* ptr, size_t npages) {
+	if (!mem_map || !ptr || npages == 0) return;
 
-	for (int segid = 0; segid < MAX_SEGMENTS; segid++) {
-		segment* seg = &segments[segid];
-		if (seg->length == 0 || seg->is_bitmap) continue;
+#ifdef CONFIG_MEM_PROFILE
+	mem::prof::record_free(MEMPROF_PMM, (void*)mem::vmm::va_to_pa((uint64_t)ptr));
+#endif
 
-		uint64_t seg_pages = seg->length / PAGE_SIZE;
-		uint64_t found = 0;
-		uint64_t start = 0;
+	uint64_t addr = mem::vmm::va_to_pa((uint64_t)ptr);
 
-		for (uint64_t j = 0; j < seg_pages; j++) {
-			uint64_t global_index = page_offset + j;
+	if (addr < MIN_ALLOC_ADDR) {
+		Log::errf("PMM: Attempt to free memory below 1 MiB (%p)", ptr);
+		STAT_ADD(failed_free_count, 1);
+		return;
+	}
 
-			if (!bitmap_test(global_index)) {
-				if (found == 0) start = j;
-				found++;
+	uint64_t pfn = addr / PAGE_SIZE;
+	if (pfn < pfn_base || pfn + npages > pfn_end) {
+		Log::errf("PMM: Free failed, pointer %p outside managed memory", ptr);
+		STAT_ADD(failed_free_count, 1);
+		return;
+	}
 
-				if (found == needed) {
-					uint64_t start_global = page_offset + start;
+	if (npages == 1) {
+		free_single(pfn_page(pfn));
+		return;
+	}
 
-					for (uint64_t k = 0; k < needed; k++) {
-						bitmap_set(start_global + k);
-					}
+	uint64_t actually_freed = 0;
+	uint64_t run_start = 0, run_len = 0;
+	uint64_t flags = sync::lock_irqsave(&zone_lock);
 
-					used_mem += needed * PAGE_SIZE;
-					free_mem -= needed * PAGE_SIZE;
-					seg->remaining_bytes -= needed * PAGE_SIZE;
-					allocation_count++;
+	for (uint64_t i = 0; i < npages; i++) {
+		page* p = pfn_page(pfn + i);
+		if (p->flags & PG_ALLOCATED) {
+			p->flags &= ~PG_ALLOCATED;
+			if (run_len == 0) run_start = pfn + i;
+			run_len++;
+			actually_freed += PAGE_SIZE;
+		} else {
+			STAT_ADD(failed_free_count, 1);
+			if (run_len) free_range(run_start, run_len);
+			run_len = 0;
+		}
+	}
+	if (run_len) free_range(run_start, run_len);
 
-					return reinterpret_cast<void*>(seg->base + start * PAGE_SIZE);
-				}
-			} else {
-				found = 0;
-			}
+	sync::unlock_irqrestore(&zone_lock, flags);
+
+	if (!actually_freed) return;
+	STAT_SUB(used_mem, actually_freed);
+	STAT_ADD(free_mem, actually_freed);
+	STAT_ADD(free_count, 1);
+}
+
+#ifdef CONFIG_PMM_SELFTEST
+static bool selftest_check(bool cond, const char* what) {
+	if (!cond) Log::errf("PMM self-test: %s", what);
+	return cond;
+}
+
+void selftest() {
+	const uint64_t saved_alloc = allocation_count, saved_failed_alloc = failed_allocation_count;
+	const uint64_t saved_free = free_count, saved_failed_free = failed_free_count;
+	const uint64_t free_before = free_mem;
+	const size_t slots = PAGE_SIZE / sizeof(uint64_t);
+	bool ok = true;
+
+	uint64_t table_pa = (uint64_t)palloc(1);
+	if (!selftest_check(table_pa != 0, "no page for the slot table")) return;
+	uint64_t* table = reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(table_pa));
+	membulkset(table, 0, PAGE_SIZE);
+
+	for (int round = 0; round < 8 && ok; round++) {
+		for (size_t i = 0; i < slots; i++) {
+			size_t n = (round & 1) ? 1 + (i % 13) : 1;
+			uint64_t pa = (uint64_t)palloc(n);
+			ok &= selftest_check(pa != 0, "allocation failed");
+			ok &= selftest_check(!(pa & (PAGE_SIZE - 1)), "unaligned allocation");
+			ok &= selftest_check(!(pa & (((uint64_t)PAGE_SIZE << order_for(n)) - 1)), "block not naturally aligned");
+			if (!ok) break;
+
+			uint64_t* first = reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(pa));
+			uint64_t* last = reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(pa + (n - 1) * PAGE_SIZE));
+			first[0] = pa;
+			last[1] = pa ^ n;
+			table[i] = pa | (n << 48);
 		}
 
-		page_offset += seg_pages;
+		for (size_t pass = 0; pass < 2; pass++) {
+			for (size_t i = pass; i < slots; i += 2) {
+				uint64_t pa = table[i] & 0xFFFFFFFFFFFF;
+				size_t n = table[i] >> 48;
+				if (!pa) continue;
+
+				uint64_t* first = reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(pa));
+				uint64_t* last = reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(pa + (n - 1) * PAGE_SIZE));
+				if (ok) ok = selftest_check(first[0] == pa && last[1] == (pa ^ n), "allocation overlapped another one");
+				free(reinterpret_cast<void*>(pa), n);
+				table[i] = 0;
+			}
+		}
 	}
 
-	failed_allocation_count++;
-	return nullptr;
-}
+	uint64_t pa = (uint64_t)palloc(1);
+	uint64_t failed_before = failed_free_count;
+	free(reinterpret_cast<void*>(pa), 1);
+	free(reinterpret_cast<void*>(pa), 1);
+	ok &= selftest_check(failed_free_count == failed_before + 1, "double free went unnoticed");
+
+	free(reinterpret_cast<void*>(table_pa), 1);
+	ok &= selftest_check(free_mem == free_before, "pages leaked");
 
+	allocation_count = saved_alloc;
+	failed_allocation_count = saved_failed_alloc;
+	free_count = saved_free;
+	failed_free_count = saved_failed_free;
+
+	if (ok) Log::printf_status("OK", "PMM self-test passed");
 }
+#endif
 
+}
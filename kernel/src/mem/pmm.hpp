@@ -12,9 +12,45 @@
 #define STAT_FAILED_ALLOC_COUNT	4
 #define STAT_FREE_COUNT			5
 #define STAT_FAILED_FREE_COUNT	6
+#define STAT_PCP_ALLOC_HITS		7
+#define STAT_PCP_REFILLS		8
+#define STAT_PCP_FREE_HITS		9
+#define STAT_PCP_DRAINS			10
+#define STAT_ZERO_POOL_HITS		11	// zeroings done ahead of time in the idle loop
+#define STAT_ZERO_POOL_MISSES	12
+
+#define PG_RESERVED		0x1	// not managed: hole, firmware or PMM metadata
+#define PG_BUDDY		0x2	// first frame of a block on a buddy free list
+#define PG_ALLOCATED	0x4	// handed out by palloc
+#define PG_PCP			0x8	// cached in a per-CPU magazine
+#define PG_SLAB			0x10	// backs a heap size-class slab
+#define PG_LARGE		0x20	// first frame of a page-sized heap allocation
+#define PG_ZERO_POOL	0x40	// zeroed and waiting in the pre-zeroed pool
 
 namespace mem::pmm {
 
+struct page {
+	page* next;
+	page* prev;
+	uint32_t flags;
+	uint8_t order;
+	uint32_t asid;	// PCID and its generation while the frame is a PML4
+
+	// heap owner data, valid while PG_SLAB or PG_LARGE is set
+	void* slab_cache;
+	void* freelist;
+	uint32_t inuse;	// live objects in a slab, or page count of a large allocation
+
+	uint32_t refcount;	// user mappings of the frame, it is freed when the last goes
+};
+
+page* pfn_to_page(uint64_t pfn);
+page* phys_to_page(uint64_t pa);
+uint64_t page_to_phys(page* p);
+
+void page_get(uint64_t pa);
+void page_put(uint64_t pa);
+
 uint64_t stat_free();
 uint64_t stat_used();
 uint64_t stat_total_mem();
@@ -25,9 +61,13 @@ uint64_t stat_get_status(uint8_t type);
 
 void initialise();
 void* palloc(size_t npages);
+void* palloc_zeroed();
 void free(void* ptr, size_t npages);
 
-void* reserve_heap(size_t npages);
+void zero_pool_refill();
+uint64_t zero_page();
+
+void selftest();
 
 }
 
@@ -0,0 +1,778 @@
+#include <mem/vma.hpp>
+#include <mem/mem.hpp>
+#include <vfs/pagecache.hpp>
+#include <cstdio>
+
+#define PAGE_SIZE 0x1000
+#define ZAP_BATCH 64
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define PF_PRESENT  0x1
+#define PF_WRITE    0x2
+#define PF_USER     0x4
+#define PF_RSVD     0x8
+#define PF_FETCH    0x10
+
+namespace mem::vma {
+
+static mm* current_mm = nullptr;
+
+static inline int height(vma* v) { return v ? v->height : 0; }
+
+static inline void update(vma* v) {
+    int l = height(v->left), r = height(v->right);
+    v->height = (l > r ? l : r) + 1;
+}
+
+static vma* rotate_right(vma* v) {
+    vma* l = v->left;
+    v->left = l->right;
+    l->right = v;
+    update(v);
+    update(l);
+    return l;
+}
+
+static vma* rotate_left(vma* v) {
+    vma* r = v->right;
+    v->right = r->left;
+    r->left = v;
+    update(v);
+    update(r);
+    return r;
+}
+
+static vma* balance(vma* v) {
+    update(v);
+    int bf = height(v->left) - height(v->right);
+    if (bf > 1) {
+        if (height(v->left->left) < height(v->left->right)) v->left = rotate_left(v->left);
+        return rotate_right(v);
+    }
+    if (bf < -1) {
+        if (height(v->right->right) < height(v->right->left)) v->right = rotate_right(v->right);
+        return rotate_left(v);
+    }
+    return v;
+}
+
+// The in-order neighbours of a new range are both on its insertion path,
+// so checking every node passed is enough to reject overlaps
+static vma* insert(vma* root, vma* v, bool* overlap) {
+    if (!root) return v;
+    if (v->start < root->end && root->start < v->end) {
+        *overlap = true;
+        return root;
+    }
+
+    if (v->start < root->start) root->left = insert(root->left, v, overlap);
+    else root->right = insert(root->right, v, overlap);
+    return *overlap ? root : balance(root);
+}
+
+static vma* remove_min(vma* root, vma** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = remove_min(root->left, min);
+    return balance(root);
+}
+
+static vma* remove(vma* root, vma* v) {
+    if (!root) return nullptr;
+    if (v->start < root->start) {
+        root->left = remove(root->left, v);
+    } else if (v->start > root->start) {
+        root->right = remove(root->right, v);
+    } else {
+        if (!root->left) return root->right;
+        if (!root->right) return root->left;
+
+        vma* succ;
+        vma* right = remove_min(root->right, &succ);
+        succ->left = root->left;
+        succ->right = right;
+        return balance(succ);
+    }
+    return balance(root);
+}
+
+static inline uint64_t prot_to_flags(uint32_t prot) {
+    uint64_t flags = PAGE_PRESENT;
+    if (prot & VMA_WRITE) flags |= PAGE_RW;
+    if (prot & VMA_USER) flags |= PAGE_USER;
+    if (!(prot & VMA_EXEC)) flags |= PAGE_NX;
+    return flags;
+}
+
+// Caller has m switched in. Unmaps [start, end) and drops the references
+// to the frames that were faulted into it.
+static void zap_range(uint64_t start, uint64_t end) {
+    uint64_t frames[ZAP_BATCH];
+
+    for (uint64_t va = start; va < end; va += ZAP_BATCH * PAGE_SIZE) {
+        size_t npages = (end - va) / PAGE_SIZE;
+        if (npages > ZAP_BATCH) npages = ZAP_BATCH;
+
+        for (size_t i = 0; i < npages; i++) {
+            frames[i] = mem::vmm::translate((void*)(va + i * PAGE_SIZE));
+        }
+
+        mem::vmm::tlb_gather tlb;
+        mem::vmm::tlb_gather_init(&tlb);
+        bool unmapped = mem::vmm::unmap_range(&tlb, (void*)va, npages);
+        mem::vmm::tlb_gather_flush(&tlb);
+        if (!unmapped) {
+            Log::errf("VMA: failed to unmap 0x%llx, leaking its frames", va);
+            continue;
+        }
+
+        for (size_t i = 0; i < npages; i++) {
+            if (frames[i]) mem::pmm::page_put(frames[i]);
+        }
+    }
+}
+
+static inline void zap(vma* v) {
+    zap_range(v->start, v->end);
+}
+
+static void free_vma(vma* v) {
+    if (v->vnode) vfs::put(v->vnode);
+    mem::heap::free(v);
+}
+
+static void destroy_tree(vma* v) {
+    if (!v) return;
+    destroy_tree(v->left);
+    destroy_tree(v->right);
+    zap(v);
+    free_vma(v);
+}
+
+mm* create_mm() {
+    void* pml4 = mem::vmm::create_pagetable();
+    if (!pml4) {
+        Log::errf("VMA: failed to allocate a page table");
+        return nullptr;
+    }
+
+    mm* m = (mm*)mem::heap::calloc(1, sizeof(mm));
+    if (!m) {
+        mem::vmm::destroy_pagetable(pml4);
+        Log::errf("VMA: failed to allocate an address space");
+        return nullptr;
+    }
+
+    m->pml4 = mem::vmm::pa_to_va((uint64_t)pml4);
+    return m;
+}
+
+void destroy_mm(mm* m) {
+    mm* prev = current_mm;
+    if (prev != m) switch_mm(m);
+
+    destroy_tree(m->root);
+    m->root = nullptr;
+
+    if (prev && prev != m) {
+        switch_mm(prev);
+    } else {
+        mem::vmm::reset_pagetable();
+        current_mm = nullptr;
+    }
+
+    mem::vmm::destroy_pagetable((void*)m->pml4);
+    mem::heap::free(m);
+}
+
+void switch_mm(mm* m) {
+    mem::vmm::switch_pagetable(m->pml4);
+    current_mm = m;
+}
+
+mm* current() {
+    return current_mm;
+}
+
+// Shares every populated page of v with dst. Writable pages are made
+// read-only in both, the first write to one copies it.
+static bool clone_vma(mm* src, mm* dst, vma* v, mem::vmm::tlb_gather* tlb) {
+    vma* c = (vma*)mem::heap::malloc(sizeof(vma));
+    if (!c) return false;
+    *c = *v;
+    c->left = c->right = nullptr;
+    c->height = 1;
+    if (c->vnode) vfs::get(c->vnode);
+
+    bool overlap = false;
+    dst->root = insert(dst->root, c, &overlap);
+    dst->nr_vmas++;
+
+    for (uint64_t va = v->start; va < v->end; va += PAGE_SIZE) {
+        uint64_t* spte = mem::vmm::get_pte(src->pml4, (void*)va);
+        if (!spte || !(*spte & PAGE_PRESENT)) continue;
+
+        uint64_t* dpte = mem::vmm::ensure_pte(dst->pml4, (void*)va, *spte);
+        if (!dpte) return false;
+
+        if ((*spte & PAGE_RW) && !(v->prot & VMA_SHARED)) {
+            *spte &= ~(uint64_t)PAGE_RW;
+            mem::vmm::tlb_gather_add(tlb, va, PAGE_SIZE, PAGE_SIZE);
+        }
+        *dpte = *spte;
+        mem::pmm::page_get(*spte & PTE_ADDR_MASK);
+    }
+    return true;
+}
+
+static bool clone_tree(mm* src, mm* dst, vma* v, mem::vmm::tlb_gather* tlb) {
+    if (!v) return true;
+    return clone_tree(src, dst, v->left, tlb) &&
+           clone_vma(src, dst, v, tlb) &&
+           clone_tree(src, dst, v->right, tlb);
+}
+
+// Caller has src switched in. Returns a copy-on-write clone of src.
+mm* clone_mm(mm* src) {
+    mm* dst = create_mm();
+    if (!dst) return nullptr;
+
+    mem::vmm::tlb_gather tlb;
+    mem::vmm::tlb_gather_init(&tlb);
+
+    uint64_t flags = sync::lock_irqsave(&src->lock);
+    bool ok = clone_tree(src, dst, src->root, &tlb);
+    mem::vmm::tlb_gather_flush(&tlb);
+    sync::unlock_irqrestore(&src->lock, flags);
+
+    if (!ok) {
+        Log::errf("VMA: out of memory cloning an address space");
+        destroy_mm(dst);
+        return nullptr;
+    }
+    return dst;
+}
+
+vma* find(mm* m, uint64_t addr) {
+    vma* v = m->root;
+    while (v) {
+        if (addr < v->start) v = v->left;
+        else if (addr >= v->end) v = v->right;
+        else return v;
+    }
+    return nullptr;
+}
+
+static inline uint64_t page_round(size_t len) {
+    return (len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+// Inserts a copy of t, which has every field but the tree links filled in
+static vma* add(mm* m, const vma* t) {
+    if ((t->start & (PAGE_SIZE - 1)) || t->end <= t->start) {
+        Log::errf("VMA: unaligned range 0x%llx-0x%llx", t->start, t->end);
+        return nullptr;
+    }
+
+    vma* v = (vma*)mem::heap::malloc(sizeof(vma));
+    if (!v) {
+        Log::errf("VMA: out of memory");
+        return nullptr;
+    }
+    *v = *t;
+    v->left = v->right = nullptr;
+    v->height = 1;
+    if (v->vnode) vfs::get(v->vnode);
+
+    bool overlap = false;
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    m->root = insert(m->root, v, &overlap);
+    if (!overlap) {
+        m->nr_vmas++;
+        m->seq++;
+    }
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    if (overlap) {
+        Log::errf("VMA: 0x%llx-0x%llx overlaps an existing mapping", v->start, v->end);
+        free_vma(v);
+        return nullptr;
+    }
+    return v;
+}
+
+vma* map_anon(mm* m, uint64_t start, size_t len, uint32_t prot, uint32_t kind) {
+    vma t = {};
+    t.start = start;
+    t.end = start + page_round(len);
+    t.prot = prot;
+    t.kind = kind;
+    return add(m, &t);
+}
+
+vma* map_file(mm* m, uint64_t start, size_t len, uint32_t prot,
+              const void* file, uint64_t file_va, size_t file_size) {
+    vma t = {};
+    t.start = start;
+    t.end = start + page_round(len);
+    t.prot = prot;
+    t.kind = VMA_FILE;
+    t.file = (const uint8_t*)file;
+    t.file_va = file_va;
+    t.file_size = file_size;
+    return add(m, &t);
+}
+
+vma* map_vnode(mm* m, uint64_t start, size_t len, uint32_t prot,
+               vfs::vnode* node, uint64_t offset) {
+    vma t = {};
+    t.start = start;
+    t.end = start + page_round(len);
+    t.prot = prot;
+    t.kind = VMA_VNODE;
+    t.vnode = node;
+    t.vnode_off = offset;
+    return add(m, &t);
+}
+
+// Caller has m switched in
+int unmap(mm* m, vma* v) {
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    if (find(m, v->start) != v) {
+        sync::unlock_irqrestore(&m->lock, flags);
+        return -1;
+    }
+    m->root = remove(m->root, v);
+    m->nr_vmas--;
+    m->seq++;
+    zap(v);
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    free_vma(v);
+    return 0;
+}
+
+bool install_page(mm* m, uint64_t va, uint64_t frame) {
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    vma* v = find(m, va);
+    uint64_t pte_flags = v ? prot_to_flags(v->prot) : 0;
+    uint64_t seq = m->seq;
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    uint64_t* pte = v ? mem::vmm::ensure_pte(m->pml4, (void*)va, pte_flags) : nullptr;
+
+    flags = sync::lock_irqsave(&m->lock);
+    bool ok = pte && m->seq == seq && !(*pte & PAGE_PRESENT);
+    if (ok) *pte = frame | pte_flags;
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    if (!ok) Log::errf("VMA: cannot install a page at 0x%llx", va);
+    return ok;
+}
+
+// Lowest VMA overlapping [start, end)
+static vma* first_overlap(vma* v, uint64_t start, uint64_t end) {
+    vma* best = nullptr;
+    while (v) {
+        if (v->end <= start) {
+            v = v->right;
+        } else {
+            if (v->start < end) best = v;
+            v = v->left;
+        }
+    }
+    return best;
+}
+
+// Splitting [start, end) out of the VMAs around it takes at most two new
+// ones, they are allocated before m->lock is taken
+struct spare_vmas {
+    vma* v[2];
+    int used;
+};
+
+static bool spares_alloc(spare_vmas* s) {
+    s->v[0] = (vma*)mem::heap::malloc(sizeof(vma));
+    s->v[1] = (vma*)mem::heap::malloc(sizeof(vma));
+    s->used = 0;
+    if (s->v[0] && s->v[1]) return true;
+
+    Log::errf("VMA: out of memory splitting a mapping");
+    if (s->v[0]) mem::heap::free(s->v[0]);
+    if (s->v[1]) mem::heap::free(s->v[1]);
+    return false;
+}
+
+static void spares_free(spare_vmas* s) {
+    for (int i = s->used; i < 2; i++) mem::heap::free(s->v[i]);
+}
+
+// Cuts v in two at addr, the new VMA takes [addr, end). Caller holds m->lock.
+static vma* split(mm* m, vma* v, uint64_t addr, spare_vmas* spares) {
+    vma* n = spares->v[spares->used++];
+    *n = *v;
+    n->start = addr;
+    n->left = n->right = nullptr;
+    n->height = 1;
+    if (n->vnode) {
+        n->vnode_off += addr - v->start;
+        vfs::get(n->vnode);
+    }
+    v->end = addr;
+
+    bool overlap = false;
+    m->root = insert(m->root, n, &overlap);
+    m->nr_vmas++;
+    m->seq++;
+    return n;
+}
+
+// Splits so that [start, end) is made of whole VMAs, returns the first or
+// null when nothing overlaps the range. With `covered`, fails unless every
+// page of the range is mapped.
+static vma* isolate(mm* m, uint64_t start, uint64_t end, bool covered, spare_vmas* spares) {
+    if (covered) {
+        uint64_t pos = start;
+        while (pos < end) {
+            vma* v = first_overlap(m->root, pos, end);
+            if (!v || v->start > pos) return nullptr;
+            pos = v->end;
+        }
+    }
+
+    vma* first = first_overlap(m->root, start, end);
+    if (!first) return nullptr;
+    if (first->start < start) first = split(m, first, start, spares);
+
+    // The range may end in a hole, so walk up to the last VMA it overlaps
+    vma* last = first;
+    for (vma* n; (n = first_overlap(m->root, last->end, end)); ) last = n;
+    if (last->end > end) split(m, last, end, spares);
+    return first;
+}
+
+// Walks the VMAs from the top down, lowering *top under each one until
+// the gap above a VMA fits len
+static bool fit_below(vma* v, uint64_t len, uint64_t* top) {
+    if (!v) return false;
+    if (fit_below(v->right, len, top)) return true;
+    if (v->end <= *top && *top - v->end >= len) return true;
+    if (v->start < *top) *top = v->start;
+    return fit_below(v->left, len, top);
+}
+
+// Highest free range of len bytes in the mmap area, 0 if there is none
+uint64_t find_free(mm* m, size_t len) {
+    len = page_round(len);
+    if (!len || len > USER_MMAP_TOP - USER_MMAP_BASE) return 0;
+
+    uint64_t top = USER_MMAP_TOP;
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    fit_below(m->root, len, &top);
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    return top >= USER_MMAP_BASE + len ? top - len : 0;
+}
+
+int unmap_range(mm* m, uint64_t start, size_t len) {
+    if ((start & (PAGE_SIZE - 1)) || !len) return -1;
+    uint64_t end = start + page_round(len);
+
+    spare_vmas spares;
+    if (!spares_alloc(&spares)) return -1;
+
+    // Removed VMAs are chained through left and freed after the unlock
+    vma* dead = nullptr;
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    isolate(m, start, end, false, &spares);
+
+    vma* v;
+    while ((v = first_overlap(m->root, start, end))) {
+        m->root = remove(m->root, v);
+        m->nr_vmas--;
+        m->seq++;
+        zap(v);
+        v->left = dead;
+        dead = v;
+    }
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    spares_free(&spares);
+    while ((v = dead)) {
+        dead = v->left;
+        free_vma(v);
+    }
+    return 0;
+}
+
+static bool accessible(vma* v) {
+    return v->prot & (VMA_READ | VMA_WRITE | VMA_EXEC);
+}
+
+// Brings the present PTEs of v in line with v->prot. Write access is only
+// ever removed here, private pages get it back through break_cow.
+static void reprotect(mm* m, vma* v, mem::vmm::tlb_gather* tlb) {
+    for (uint64_t va = v->start; va < v->end; va += PAGE_SIZE) {
+        uint64_t* pte = mem::vmm::get_pte(m->pml4, (void*)va);
+        if (!pte || !(*pte & PAGE_PRESENT)) continue;
+
+        uint64_t e = *pte;
+        if (!(v->prot & VMA_WRITE)) e &= ~(uint64_t)PAGE_RW;
+        else if (v->prot & VMA_SHARED) e |= PAGE_RW;
+        if (v->prot & VMA_EXEC) e &= ~(uint64_t)PAGE_NX;
+        else e |= PAGE_NX;
+        // x86 cannot take read access away from a present page, PROT_NONE
+        // hides it from user mode instead
+        if ((v->prot & VMA_USER) && accessible(v)) e |= PAGE_USER;
+        else e &= ~(uint64_t)PAGE_USER;
+
+        if (e != *pte) {
+            *pte = e;
+            mem::vmm::tlb_gather_add(tlb, va, PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+}
+
+// Only the access bits change, VMA_USER, VMA_SHARED and VMA_MAYWRITE stay as mapped
+int protect(mm* m, uint64_t start, size_t len, uint32_t prot) {
+    if ((start & (PAGE_SIZE - 1)) || !len) return -1;
+    uint64_t end = start + page_round(len);
+    const uint32_t access = VMA_READ | VMA_WRITE | VMA_EXEC;
+
+    spare_vmas spares;
+    if (!spares_alloc(&spares)) return -1;
+
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    vma* v = isolate(m, start, end, true, &spares);
+    if (!v) {
+        sync::unlock_irqrestore(&m->lock, flags);
+        spares_free(&spares);
+        return -1;
+    }
+    m->seq++;
+
+    mem::vmm::tlb_gather tlb;
+    mem::vmm::tlb_gather_init(&tlb);
+    for (; v; v = first_overlap(m->root, v->end, end)) {
+        v->prot = (v->prot & ~access) | (prot & access);
+        reprotect(m, v, &tlb);
+    }
+    mem::vmm::tlb_gather_flush(&tlb);
+
+    sync::unlock_irqrestore(&m->lock, flags);
+    spares_free(&spares);
+    return 0;
+}
+
+// Drops the pages of a range but keeps the mapping. Anonymous memory
+// reads back as zeros, file pages come back from the page cache.
+int discard(mm* m, uint64_t start, size_t len) {
+    if ((start & (PAGE_SIZE - 1)) || !len) return -1;
+    uint64_t end = start + page_round(len);
+
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    m->seq++;
+    for (vma* v = first_overlap(m->root, start, end); v; v = first_overlap(m->root, v->end, end)) {
+        zap_range(v->start > start ? v->start : start, v->end < end ? v->end : end);
+    }
+    sync::unlock_irqrestore(&m->lock, flags);
+    return 0;
+}
+
+// Copies the part of the backing image that overlaps the page at va
+static void fill_from_file(const vma* v, uint64_t va, uint8_t* dst) {
+    uint64_t lo = va > v->file_va ? va : v->file_va;
+    uint64_t hi = va + PAGE_SIZE;
+    if (hi > v->file_va + v->file_size) hi = v->file_va + v->file_size;
+    if (lo >= hi) return;
+
+    mem::memcpy(dst + (lo - va), v->file + (lo - v->file_va), hi - lo);
+}
+
+static void flush_page(uint64_t va) {
+    mem::vmm::tlb_gather tlb;
+    mem::vmm::tlb_gather_init(&tlb);
+    mem::vmm::tlb_gather_add(&tlb, va, PAGE_SIZE, PAGE_SIZE);
+    mem::vmm::tlb_gather_flush(&tlb);
+}
+
+// Returns a private copy of old, or a fresh zeroed page for the zero page
+static uint64_t copy_page(uint64_t old, uint64_t va) {
+    bool from_zero = old == mem::pmm::zero_page();
+    void* frame = from_zero ? mem::pmm::palloc_zeroed() : mem::pmm::palloc(1);
+    if (!frame) {
+        Log::errf("VMA: out of memory copying 0x%llx", va);
+        return 0;
+    }
+
+    if (!from_zero) {
+        mem::memcpy((void*)mem::vmm::pa_to_va((uint64_t)frame), (void*)mem::vmm::pa_to_va(old), PAGE_SIZE);
+    }
+    mem::pmm::phys_to_page((uint64_t)frame)->refcount = 1;
+    return (uint64_t)frame;
+}
+
+// Returns a referenced frame to back the page at va on first touch, and
+// drops PAGE_RW from *pte_flags when it is to be copied on write. Private
+// anonymous pages that are only read share the zero page, vnode pages map
+// the page cache frame itself. Can read from disk, so runs without m->lock.
+static uint64_t new_page(const vma* v, uint64_t va, bool write, uint64_t* pte_flags) {
+    if (v->kind == VMA_VNODE) {
+        uint64_t pos = v->vnode_off + (va - v->start);
+        if (pos >= v->vnode->size) return 0;
+
+        uint64_t frame = vfs::pagecache::get_page(v->vnode, pos / PAGE_SIZE);
+        if (!frame) {
+            Log::errf("VMA: failed to read the page for 0x%llx", va);
+            return 0;
+        }
+        if (!(v->prot & VMA_SHARED)) {
+            if (write) return copy_page(frame, va);
+            *pte_flags &= ~(uint64_t)PAGE_RW;
+        }
+        mem::pmm::page_get(frame);
+        return frame;
+    }
+
+    uint64_t zero = mem::pmm::zero_page();
+    if (v->kind != VMA_FILE && !(v->prot & VMA_SHARED) && !write && zero) {
+        mem::pmm::page_get(zero);
+        *pte_flags &= ~(uint64_t)PAGE_RW;
+        return zero;
+    }
+
+    // A page the image covers completely is overwritten anyway
+    bool covered = v->kind == VMA_FILE && v->file_va <= va &&
+                   va + PAGE_SIZE <= v->file_va + v->file_size;
+    void* frame = covered ? mem::pmm::palloc(1) : mem::pmm::palloc_zeroed();
+    if (!frame) {
+        Log::errf("VMA: out of memory backing 0x%llx", va);
+        return 0;
+    }
+
+    uint8_t* page = (uint8_t*)mem::vmm::pa_to_va((uint64_t)frame);
+    if (v->kind == VMA_FILE) fill_from_file(v, va, page);
+
+    mem::pmm::phys_to_page((uint64_t)frame)->refcount = 1;
+    return (uint64_t)frame;
+}
+
+// Whether a write to a read-only page of v can just make it writable: shared
+// mappings write to the page they have, private ones once every other sharer
+// from clone_mm is gone. The zero page is always copied.
+static bool cow_in_place(const vma* v, uint64_t frame) {
+    if (frame == mem::pmm::zero_page()) return false;
+    if (v->prot & VMA_SHARED) return true;
+
+    mem::pmm::page* p = mem::pmm::phys_to_page(frame);
+    return p && __atomic_load_n(&p->refcount, __ATOMIC_ACQUIRE) == 1;
+}
+
+// Backs the page at addr, or gives it a private copy for a write. The page
+// is allocated and filled without m->lock from a snapshot of the VMA, and
+// only installed if neither the PTE nor the VMAs changed in the meantime.
+// Losing that race still counts as handled, the access is just retried.
+static bool fault_in(mm* m, uint64_t addr, uint64_t error_code) {
+    uint64_t va = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    bool write = error_code & PF_WRITE;
+
+    uint64_t flags = sync::lock_irqsave(&m->lock);
+    vma* v = find(m, addr);
+    if (!v || !accessible(v) ||
+        (write && !(v->prot & VMA_WRITE)) ||
+        ((error_code & PF_USER) && !(v->prot & VMA_USER)) ||
+        ((error_code & PF_FETCH) && !(v->prot & VMA_EXEC))) {
+        sync::unlock_irqrestore(&m->lock, flags);
+        return false;
+    }
+
+    uint64_t* pte = mem::vmm::get_pte(m->pml4, (void*)va);
+    uint64_t old = pte ? *pte : 0;
+    bool present = old & PAGE_PRESENT;
+    if (present) {
+        bool handled = false;
+        if (!(error_code & PF_PRESENT) || (write && (old & PAGE_RW))) {
+            handled = true;
+        } else if (write && cow_in_place(v, old & PTE_ADDR_MASK)) {
+            *pte = old | PAGE_RW;
+            flush_page(va);
+            handled = true;
+        }
+        if (handled || !write) {
+            sync::unlock_irqrestore(&m->lock, flags);
+            return handled;
+        }
+    }
+
+    vma snap = *v;
+    uint64_t seq = m->seq;
+    uint64_t old_frame = present ? old & PTE_ADDR_MASK : 0;
+    if (old_frame) mem::pmm::page_get(old_frame);
+    if (snap.vnode) vfs::get(snap.vnode);
+    sync::unlock_irqrestore(&m->lock, flags);
+
+    uint64_t pte_flags = prot_to_flags(snap.prot);
+    uint64_t frame = old_frame ? copy_page(old_frame, va) : new_page(&snap, va, write, &pte_flags);
+    uint64_t entry = old_frame ? frame | (old & ~PTE_ADDR_MASK) | PAGE_RW : frame | pte_flags;
+    pte = frame ? mem::vmm::ensure_pte(m->pml4, (void*)va, pte_flags) : nullptr;
+
+    bool installed = false;
+    if (pte) {
+        flags = sync::lock_irqsave(&m->lock);
+        if (m->seq == seq && *pte == old) {
+            *pte = entry;
+            if (present) flush_page(va);
+            installed = true;
+        }
+        sync::unlock_irqrestore(&m->lock, flags);
+    }
+
+    if (frame && !installed) mem::pmm::page_put(frame);
+    if (old_frame) {
+        // Ours, and the one the old PTE held if it was replaced
+        mem::pmm::page_put(old_frame);
+        if (installed) mem::pmm::page_put(old_frame);
+    }
+    if (snap.vnode) vfs::put(snap.vnode);
+    return pte != nullptr;
+}
+
+// Resolves a fault in the current address space: not-present pages are
+// backed on first touch, writes to shared pages are copied. Returns false
+// when the access is not covered by a VMA that allows it.
+bool handle_fault(uint64_t addr, uint64_t error_code) {
+    mm* m = current_mm;
+    if (!m || (error_code & PF_RSVD)) return false;
+    return fault_in(m, addr, error_code);
+}
+
+// Faults in every not yet present page of a range ahead of use. Writable
+// VMAs take a write fault, so they get pages of their own rather than the
+// zero page or a read-only page cache frame.
+int populate(mm* m, uint64_t start, size_t len) {
+    if ((start & (PAGE_SIZE - 1)) || !len) return -1;
+    uint64_t end = start + page_round(len);
+
+    uint64_t va = start;
+    while (va < end) {
+        uint64_t flags = sync::lock_irqsave(&m->lock);
+        vma* v = first_overlap(m->root, va, end);
+        bool skip = v && !accessible(v);
+        uint64_t error_code = 0;
+        if (v && (v->prot & VMA_WRITE)) error_code |= PF_WRITE;
+        if (v && (v->prot & VMA_USER)) error_code |= PF_USER;
+        if (v && v->start > va) va = v->start;
+        if (skip) va = v->end;
+        sync::unlock_irqrestore(&m->lock, flags);
+
+        if (!v) break;
+        if (skip) continue;
+        if (!fault_in(m, va, error_code)) break;
+        va += PAGE_SIZE;
+    }
+    return 0;
+}
+
+}
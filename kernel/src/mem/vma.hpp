@@ -0,0 +1,91 @@
+#ifndef VMA_HPP
+#define VMA_HPP 1
+
+#include <cstdint>
+#include <cstddef>
+#include <sync/spinlock.hpp>
+
+#define VMA_ANON    0   // zero filled on first touch
+#define VMA_FILE    1   // filled from an in-memory image, zero past its end
+#define VMA_STACK   2   // anonymous, below a guard page
+#define VMA_VNODE   3   // pages of a vnode's page cache, mapped in place
+
+#define VMA_READ    0x1
+#define VMA_WRITE   0x2
+#define VMA_EXEC    0x4
+#define VMA_USER    0x8
+#define VMA_SHARED  0x10    // writes go to the backing pages, never copied
+#define VMA_MAYWRITE 0x20   // shared vnode mapping that mprotect may make writable
+
+// Top of the initial user stack, the guard page sits below the stack VMA
+#define USER_STACK_TOP  0x00007FFFFFFFF000ULL
+#define USER_STACK_SIZE (8ULL << 20)
+
+// mmap picks addresses top down from just below the stack guard page
+#define USER_MMAP_TOP   (USER_STACK_TOP - USER_STACK_SIZE - 0x1000)
+#define USER_MMAP_BASE  0x0000000100000000ULL
+
+namespace vfs { struct vnode; }
+
+namespace mem::vma {
+
+// A page aligned range [start, end) of one address space. VMAs never
+// overlap and are kept in an AVL tree ordered by start.
+struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t prot;
+    uint32_t kind;
+
+    // VMA_FILE backing: bytes [file_va, file_va + file_size) come from file
+    const uint8_t* file;
+    uint64_t file_va;
+    uint64_t file_size;
+
+    // VMA_VNODE backing: the VMA starts at byte vnode_off of vnode
+    vfs::vnode* vnode;
+    uint64_t vnode_off;
+
+    vma* left;
+    vma* right;
+    int height;
+};
+
+struct mm {
+    uint64_t pml4;
+    vma* root;
+    size_t nr_vmas;
+    uint64_t seq;   // bumped under lock whenever VMAs or their pages change
+    sync::spinlock lock;
+};
+
+mm* create_mm();
+mm* clone_mm(mm* src);
+void destroy_mm(mm* m);
+void switch_mm(mm* m);
+mm* current();
+
+vma* find(mm* m, uint64_t addr);
+vma* map_anon(mm* m, uint64_t start, size_t len, uint32_t prot, uint32_t kind);
+vma* map_file(mm* m, uint64_t start, size_t len, uint32_t prot,
+              const void* file, uint64_t file_va, size_t file_size);
+vma* map_vnode(mm* m, uint64_t start, size_t len, uint32_t prot,
+               vfs::vnode* node, uint64_t offset);
+int unmap(mm* m, vma* v);
+// Maps an already filled frame at va, which must be inside a VMA. m need
+// not be switched in. Takes over the caller's reference to the frame.
+bool install_page(mm* m, uint64_t va, uint64_t frame);
+
+// Ranges may cover several VMAs or parts of them, VMAs are split at the
+// edges as needed. Caller has m switched in.
+uint64_t find_free(mm* m, size_t len);
+int unmap_range(mm* m, uint64_t start, size_t len);
+int protect(mm* m, uint64_t start, size_t len, uint32_t prot);
+int discard(mm* m, uint64_t start, size_t len);
+int populate(mm* m, uint64_t start, size_t len);
+
+bool handle_fault(uint64_t addr, uint64_t error_code);
+
+}
+
+#endif /* VMA_HPP */
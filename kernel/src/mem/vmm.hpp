@@ -2,11 +2,31 @@
 #define VMM_HPP 1
 
 #include <mem/mem.hpp>
+#include <config.hpp>
 
 #include <cstddef>
 
+// Virtual window the kernel heap arena grows into
+#define KHEAP_BASE 0xFFFFA00000000000ULL
+#define KHEAP_SIZE (64ULL << 30)
+
 namespace mem::vmm {
 
+enum CacheMode {
+    CACHE_WB,
+    CACHE_WC,
+    CACHE_UC,
+};
+
+// Pending TLB invalidations, flushed once after a batch of page table edits.
+// Page tables unhooked by the batch are only freed after the flush.
+struct tlb_gather {
+    uint64_t start;
+    uint64_t end;
+    uint64_t stride;
+    uint64_t* freed;
+};
+
 void* create_pagetable();
 void destroy_pagetable(void* pml4_ptr);
 void switch_pagetable(uint64_t ptr);
@@ -21,7 +41,25 @@ void print_mem();
 void* valloc(size_t npages);
 void free(void* ptr, size_t npages);
 uint64_t mmap(void* paddr, void* vaddr, size_t npages, uint64_t attributes);
-void munmap(void* vaddr, size_t npages);
+bool munmap(void* vaddr, size_t npages);
+uint64_t translate(void* vaddr);
+uint64_t* get_pte(uint64_t pml4, void* vaddr);
+uint64_t* ensure_pte(uint64_t pml4, void* vaddr, uint64_t flags);
+
+void tlb_gather_init(tlb_gather* tlb);
+void tlb_gather_add(tlb_gather* tlb, uint64_t va, uint64_t size, uint64_t stride);
+void tlb_gather_flush(tlb_gather* tlb);
+uint64_t map_range(tlb_gather* tlb, void* paddr, void* vaddr, size_t npages, uint64_t attributes);
+bool unmap_range(tlb_gather* tlb, void* vaddr, size_t npages);
+void reserve_kernel_range(void* vaddr, size_t npages);
+
+void* ioremap(uint64_t phys, size_t size, CacheMode mode);
+bool iounmap(void* vaddr, size_t size);
+extern "C" void* vmm_map_framebuffer(void* vaddr, size_t size);
+
+#ifdef CONFIG_VMM_PCID_BENCH
+void pcid_benchmark();
+#endif
 
 }
 
@@ -150,6 +150,11 @@ uint64_t initialise() {
                mcfg->allocations[i].start_bus,
                mcfg->allocations[i].end_bus);
 #endif
+        // ECAM is not RAM, so it is not in the direct map until mapped here
+        if (mcfg->allocations[i].base_address) {
+            uint64_t buses = mcfg->allocations[i].end_bus - mcfg->allocations[i].start_bus + 1;
+            mem::vmm::ioremap(mcfg->allocations[i].base_address, buses << 20, mem::vmm::CACHE_UC);
+        }
     }
 
 #ifdef CONFIG_PCI_VERBOSE
@@ -0,0 +1,37 @@
+#ifndef SPINLOCK_HPP
+#define SPINLOCK_HPP 1
+
+#include <cstdint>
+
+namespace sync {
+
+struct spinlock {
+	volatile bool locked;
+};
+
+static inline uint64_t irq_save() {
+	uint64_t flags;
+	asm volatile ("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+	if (flags & 0x200) asm volatile ("sti" ::: "memory");
+}
+
+static inline uint64_t lock_irqsave(spinlock* lock) {
+	uint64_t flags = irq_save();
+	while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+		while (lock->locked) asm volatile ("pause");
+	}
+	return flags;
+}
+
+static inline void unlock_irqrestore(spinlock* lock, uint64_t flags) {
+	__atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+	irq_restore(flags);
+}
+
+}
+
+#endif /* SPINLOCK_HPP */
@@ -0,0 +1,101 @@
+#include "dcache.hpp"
+#include "tmpfs.hpp"
+#include <mem/mem.hpp>
+#include <cstring>
+#include <cstdio>
+
+namespace tmpfs::dcache {
+
+#define DCACHE_INITIAL_BUCKETS 256
+
+static node_struct** buckets = nullptr;
+static size_t nbuckets = 0;
+static size_t nentries = 0;
+
+// FNV-1a over the component, names are not NUL terminated inside paths
+uint32_t hash_name(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline size_t bucket_of(node_struct* parent, uint32_t hash) {
+    uint64_t key = reinterpret_cast<uint64_t>(parent) ^ hash;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (key >> 32) & (nbuckets - 1);
+}
+
+static void grow() {
+    size_t count = nbuckets * 2;
+    node_struct** table = (node_struct**)mem::heap::malloc(count * sizeof(node_struct*));
+    if (!table) return;  // keep the longer chains, lookups still work
+    mem::memset(table, 0, count * sizeof(node_struct*));
+
+    node_struct** old = buckets;
+    size_t old_count = nbuckets;
+    buckets = table;
+    nbuckets = count;
+
+    for (size_t i = 0; i < old_count; i++) {
+        node_struct* n = old[i];
+        while (n) {
+            node_struct* next = n->hash_next;
+            size_t b = bucket_of(n->parent, n->name_hash);
+            n->hash_next = buckets[b];
+            buckets[b] = n;
+            n = next;
+        }
+    }
+    mem::heap::free(old);
+}
+
+void initialise() {
+    buckets = (node_struct**)mem::heap::malloc(DCACHE_INITIAL_BUCKETS * sizeof(node_struct*));
+    if (!buckets) {
+        Log::errf("dcache: no memory for the hash table");
+        return;
+    }
+    mem::memset(buckets, 0, DCACHE_INITIAL_BUCKETS * sizeof(node_struct*));
+    nbuckets = DCACHE_INITIAL_BUCKETS;
+}
+
+node_struct* lookup(node_struct* parent, const char* name, size_t len) {
+    if (!buckets) return nullptr;
+
+    uint32_t hash = hash_name(name, len);
+    for (node_struct* n = buckets[bucket_of(parent, hash)]; n; n = n->hash_next) {
+        if (n->name_hash == hash && n->parent == parent &&
+            mem::memcmp(n->name, name, len) == 0 && n->name[len] == '\0')
+            return n;
+    }
+    return nullptr;
+}
+
+// node->name and node->parent must be final, rename removes and reinserts
+void insert(node_struct* node) {
+    if (!buckets) return;
+
+    node->name_hash = hash_name(node->name, strlen(node->name));
+    size_t b = bucket_of(node->parent, node->name_hash);
+    node->hash_next = buckets[b];
+    buckets[b] = node;
+
+    if (++nentries > nbuckets) grow();
+}
+
+void remove(node_struct* node) {
+    if (!buckets) return;
+
+    node_struct** link = &buckets[bucket_of(node->parent, node->name_hash)];
+    while (*link && *link != node) link = &(*link)->hash_next;
+    if (!*link) return;
+
+    *link = node->hash_next;
+    node->hash_next = nullptr;
+    nentries--;
+}
+
+}
@@ -0,0 +1,23 @@
+#ifndef DCACHE_HPP
+#define DCACHE_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+
+struct node_struct;
+
+// Hash of (parent, name) for every node in the tree. tmpfs lives entirely
+// in memory, so every node is indexed and a miss is a definite ENOENT.
+namespace tmpfs::dcache {
+
+void initialise();
+
+uint32_t hash_name(const char* name, size_t len);
+
+node_struct* lookup(node_struct* parent, const char* name, size_t len);
+void insert(node_struct* node);
+void remove(node_struct* node);
+
+}
+
+#endif /* DCACHE_HPP */
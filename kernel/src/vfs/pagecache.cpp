@@ -0,0 +1,93 @@
+#include "pagecache.hpp"
+#include <mem/mem.hpp>
+
+namespace vfs::pagecache {
+
+static constexpr size_t PAGE_SIZE = 0x1000;
+
+uint64_t get_page(vnode* n, uint64_t index, bool whole) {
+    uint64_t frame = pages::lookup(&n->pages, index);
+    if (frame) return frame;
+
+    // Nothing to fetch past the end or without a backing store
+    bool fill = !whole && n->ops->readpage && index * PAGE_SIZE < n->size;
+    frame = pages::get(&n->pages, index, !whole && !fill);
+    if (!frame || !fill) return frame;
+
+    if (n->ops->readpage(n, index, (void*)mem::vmm::pa_to_va(frame)) < 0) {
+        pages::erase(&n->pages, index);
+        return 0;
+    }
+    return frame;
+}
+
+ssize_t read(vnode* n, void* buf, size_t count, off_t offset) {
+    size_t rem = offset < (off_t)n->size ? n->size - offset : 0;
+    size_t to_read = count < rem ? count : rem;
+
+    char* out = (char*)buf;
+    for (size_t done = 0; done < to_read;) {
+        uint64_t pos = offset + done;
+        size_t off = pos % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - off;
+        if (chunk > to_read - done) chunk = to_read - done;
+
+        uint64_t frame = get_page(n, pos / PAGE_SIZE);
+        if (!frame) return done ? (ssize_t)done : -1;
+        mem::memcpy(out + done, (char*)mem::vmm::pa_to_va(frame) + off, chunk);
+        done += chunk;
+    }
+    return to_read;
+}
+
+ssize_t write(vnode* n, const void* buf, size_t count, off_t offset) {
+    // Devices have a fixed size, files grow
+    if (n->type == VNODE_BLKDEV) {
+        size_t rem = offset < (off_t)n->size ? n->size - offset : 0;
+        if (count > rem) count = rem;
+    }
+
+    const char* in = (const char*)buf;
+    for (size_t done = 0; done < count;) {
+        uint64_t pos = offset + done;
+        uint64_t index = pos / PAGE_SIZE;
+        size_t off = pos % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - off;
+        if (chunk > count - done) chunk = count - done;
+
+        uint64_t frame = get_page(n, index, chunk == PAGE_SIZE);
+        if (!frame) {
+            if (!done) return -1;
+            count = done;
+            break;
+        }
+        char* page = (char*)mem::vmm::pa_to_va(frame);
+        mem::memcpy(page + off, in + done, chunk);
+
+        if (n->ops->writepage && n->ops->writepage(n, index, page) < 0) {
+            // The cached copy no longer matches the backing store
+            pages::erase(&n->pages, index);
+            if (!done) return -1;
+            count = done;
+            break;
+        }
+        done += chunk;
+    }
+
+    if (offset + count > n->size) n->size = offset + count;
+    return count;
+}
+
+// Growing only moves the size, the new range reads as a hole
+void truncate(vnode* n, off_t length) {
+    if ((size_t)length < n->size) {
+        pages::truncate(&n->pages, (length + PAGE_SIZE - 1) / PAGE_SIZE);
+        uint64_t frame = (length % PAGE_SIZE) ? pages::lookup(&n->pages, length / PAGE_SIZE) : 0;
+        if (frame) {
+            mem::memset((char*)mem::vmm::pa_to_va(frame) + length % PAGE_SIZE, 0, PAGE_SIZE - length % PAGE_SIZE);
+        }
+    }
+    n->size = length;
+}
+
+}
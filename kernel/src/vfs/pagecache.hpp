@@ -0,0 +1,22 @@
+#ifndef PAGECACHE_HPP
+#define PAGECACHE_HPP 1
+
+#include "vfs.hpp"
+
+// File data cached in vnode::pages. A miss is filled through the vnode's
+// readpage op, so a page is fetched from its backing store at most once
+// while it stays cached. Writes go through to writepage straight away,
+// the cache never holds dirty data that fsync would have to flush.
+namespace vfs::pagecache {
+
+// Frame caching page index of n. whole means the caller is about to
+// overwrite the entire page, so it is not filled first.
+uint64_t get_page(vnode* n, uint64_t index, bool whole = false);
+
+ssize_t read(vnode* n, void* buf, size_t count, off_t offset);
+ssize_t write(vnode* n, const void* buf, size_t count, off_t offset);
+void truncate(vnode* n, off_t length);
+
+}
+
+#endif /* PAGECACHE_HPP */
@@ -0,0 +1,160 @@
+#include "pages.hpp"
+#include <mem/mem.hpp>
+#include <cstdio>
+
+namespace vfs::pages {
+
+#define TREE_SHIFT   9
+#define TREE_ENTRIES 512
+#define TREE_MAX_HEIGHT 6
+
+static inline uint64_t* table(uint64_t pa) {
+    return reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(pa));
+}
+
+static inline uint64_t span(int level) {
+    return 1ULL << (TREE_SHIFT * (level - 1));
+}
+
+static uint64_t alloc_table() {
+    return reinterpret_cast<uint64_t>(mem::pmm::palloc_zeroed());
+}
+
+// Drops a subtree: frames lose the tree's reference, tables are freed
+static void release(uint64_t entry, int level) {
+    if (level == 0) {
+        mem::pmm::page_put(entry);
+        return;
+    }
+    uint64_t* t = table(entry);
+    for (int i = 0; i < TREE_ENTRIES; i++) {
+        if (t[i]) release(t[i], level - 1);
+    }
+    mem::pmm::free(reinterpret_cast<void*>(entry), 1);
+}
+
+// Returns the data frame for a page index, 0 for a hole
+uint64_t lookup(page_tree* tree, uint64_t index) {
+    if (!tree->root || index >= span(tree->height + 1)) return 0;
+
+    uint64_t pa = tree->root;
+    for (int level = tree->height; level > 0 && pa; level--) {
+        pa = table(pa)[(index / span(level)) % TREE_ENTRIES];
+    }
+    return pa;
+}
+
+// Returns the data frame for a page index, allocating tables and the
+// frame as needed. `zeroed` is for callers that will not overwrite the
+// whole page. Returns 0 when out of memory.
+uint64_t get(page_tree* tree, uint64_t index, bool zeroed) {
+    if (!tree->root) {
+        tree->height = 1;
+        while (index >= span(tree->height + 1)) tree->height++;
+        if (tree->height > TREE_MAX_HEIGHT || !(tree->root = alloc_table())) {
+            tree->height = 0;
+            return 0;
+        }
+    }
+    while (index >= span(tree->height + 1)) {
+        if (tree->height == TREE_MAX_HEIGHT) return 0;
+        uint64_t top = alloc_table();
+        if (!top) return 0;
+        table(top)[0] = tree->root;
+        tree->root = top;
+        tree->height++;
+    }
+
+    uint64_t* slot = nullptr;
+    uint64_t pa = tree->root;
+    for (int level = tree->height; level > 0; level--) {
+        slot = &table(pa)[(index / span(level)) % TREE_ENTRIES];
+        if (!*slot) {
+            uint64_t child = level > 1 ? alloc_table()
+                : reinterpret_cast<uint64_t>(zeroed ? mem::pmm::palloc_zeroed() : mem::pmm::palloc(1));
+            if (!child) return 0;
+            if (level == 1) mem::pmm::phys_to_page(child)->refcount = 1;
+            *slot = child;
+        }
+        pa = *slot;
+    }
+    return pa;
+}
+
+// Drops a single page, the tables above it stay
+void erase(page_tree* tree, uint64_t index) {
+    if (!tree->root || index >= span(tree->height + 1)) return;
+
+    uint64_t* slot = nullptr;
+    uint64_t pa = tree->root;
+    for (int level = tree->height; level > 0; level--) {
+        slot = &table(pa)[(index / span(level)) % TREE_ENTRIES];
+        if (!(pa = *slot)) return;
+    }
+    mem::pmm::page_put(pa);
+    *slot = 0;
+}
+
+static bool trim(uint64_t pa, int level, uint64_t base, uint64_t keep) {
+    uint64_t* t = table(pa);
+    bool empty = true;
+    for (int i = 0; i < TREE_ENTRIES; i++) {
+        if (!t[i]) continue;
+        uint64_t start = base + i * span(level);
+        if (start >= keep) {
+            release(t[i], level - 1);
+            t[i] = 0;
+        } else if (level > 1 && start + span(level) > keep) {
+            if (trim(t[i], level - 1, start, keep)) {
+                mem::pmm::free(reinterpret_cast<void*>(t[i]), 1);
+                t[i] = 0;
+            } else {
+                empty = false;
+            }
+        } else {
+            empty = false;
+        }
+    }
+    return empty;
+}
+
+// Drops every page from index npages on, truncate(tree, 0) empties it
+void truncate(page_tree* tree, uint64_t npages) {
+    if (!tree->root) return;
+    if (trim(tree->root, tree->height, 0, npages)) {
+        mem::pmm::free(reinterpret_cast<void*>(tree->root), 1);
+        tree->root = 0;
+        tree->height = 0;
+    }
+}
+
+static uint64_t clone_level(uint64_t src, int level) {
+    if (level == 0) {
+        mem::pmm::page_get(src);
+        return src;
+    }
+    uint64_t dst = alloc_table();
+    if (!dst) return 0;
+    uint64_t* s = table(src);
+    uint64_t* d = table(dst);
+    for (int i = 0; i < TREE_ENTRIES; i++) {
+        if (!s[i]) continue;
+        if (!(d[i] = clone_level(s[i], level - 1))) {
+            release(dst, level);
+            return 0;
+        }
+    }
+    return dst;
+}
+
+// Builds a second tree over the same frames, each gaining a reference
+bool clone(page_tree* dst, page_tree* src) {
+    dst->root = 0;
+    dst->height = 0;
+    if (!src->root) return true;
+    if (!(dst->root = clone_level(src->root, src->height))) return false;
+    dst->height = src->height;
+    return true;
+}
+
+}
@@ -0,0 +1,26 @@
+#ifndef VFS_PAGES_HPP
+#define VFS_PAGES_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+
+// The page cache of one vnode: 4 KiB frames in a radix tree with 512
+// slots per level, laid out like the page tables. Holes are simply missing
+// frames. The frames are refcounted pmm pages so they can be mapped into
+// user space.
+struct page_tree {
+    uint64_t root;      // physical address of the top table, 0 while empty
+    uint8_t height;     // table levels, the tree covers 512^height pages
+};
+
+namespace vfs::pages {
+
+uint64_t lookup(page_tree* tree, uint64_t index);
+uint64_t get(page_tree* tree, uint64_t index, bool zeroed);
+void erase(page_tree* tree, uint64_t index);
+void truncate(page_tree* tree, uint64_t npages);
+bool clone(page_tree* dst, page_tree* src);
+
+}
+
+#endif /* VFS_PAGES_HPP */
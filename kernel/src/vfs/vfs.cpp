@@ -0,0 +1,589 @@
+#include "vfs.hpp"
+#include <cstring>
+#include <cstdio>
+#include <mem/mem.hpp>
+
+namespace vfs {
+
+#define VFS_MAX_FILESYSTEMS 8
+
+static const filesystem* filesystems[VFS_MAX_FILESYSTEMS];
+static superblock* mounts = nullptr;
+
+static vnode* root = nullptr;
+static vnode* cwd = nullptr;
+
+static fdtable* current_files = nullptr;
+
+void initialise() {
+    for (int i = 0; i < VFS_MAX_FILESYSTEMS; i++) filesystems[i] = nullptr;
+    mounts = nullptr;
+    root = cwd = nullptr;
+
+    // Kernel users get their own table, processes start from a clone of it
+    current_files = create_fdtable();
+    if (!current_files) Log::errf("vfs: Failed to allocate the kernel fd table");
+}
+
+int register_filesystem(const filesystem* fs) {
+    for (int i = 0; i < VFS_MAX_FILESYSTEMS; i++) {
+        if (!filesystems[i]) {
+            filesystems[i] = fs;
+            return 0;
+        }
+    }
+    Log::errf("vfs: No room to register %s", fs->name);
+    return -1;
+}
+
+void get(vnode* n) {
+    n->refcount++;
+}
+
+void put(vnode* n) {
+    if (--n->refcount > 0) return;
+    if (n->ops->release) n->ops->release(n);
+}
+
+// Splits the next component off *path, skipping repeated slashes.
+// Returns false once the path is used up.
+static bool next_component(const char** path, const char** name, size_t* len) {
+    const char* p = *path;
+    while (*p == '/') p++;
+    if (!*p) return false;
+
+    const char* start = p;
+    while (*p && *p != '/') p++;
+    *name = start;
+    *len = p - start;
+    *path = p;
+    return true;
+}
+
+static bool last_component(const char* rest) {
+    while (*rest == '/') rest++;
+    return *rest == '\0';
+}
+
+static bool is_dot(const char* name, size_t len) {
+    return (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+static vnode* follow_mounts(vnode* n) {
+    while (n->mounted) n = n->mounted->root;
+    return n;
+}
+
+static vnode* step(vnode* curr, const char* name, size_t len) {
+    if (len == 1 && name[0] == '.') return curr;
+    if (len == 2 && name[0] == '.' && name[1] == '.') {
+        if (curr == root) return curr;
+        // Leaving a mounted filesystem goes through the directory it covers
+        while (curr == curr->sb->root && curr->sb->covered) curr = curr->sb->covered;
+    }
+    if (curr->type != VNODE_DIR || !curr->ops->lookup) return nullptr;
+
+    vnode* child = curr->ops->lookup(curr, name, len);
+    return child ? follow_mounts(child) : nullptr;
+}
+
+// Walks path from base. With last set, stops at the directory holding the
+// final component and hands that component back instead of looking it up.
+static vnode* walk(vnode* base, const char* path, const char** last, size_t* last_len) {
+    if (!base || !path) return nullptr;
+
+    vnode* curr = (path[0] == '/') ? root : base;
+
+    const char* name;
+    size_t len;
+    while (next_component(&path, &name, &len)) {
+        if (last && last_component(path)) {
+            if (curr->type != VNODE_DIR) return nullptr;
+            *last = name;
+            *last_len = len;
+            return curr;
+        }
+        curr = step(curr, name, len);
+        if (!curr) return nullptr;
+    }
+
+    return last ? nullptr : curr;
+}
+
+vnode* resolve(const char* path) {
+    return walk(cwd, path, nullptr, nullptr);
+}
+
+// The entry itself, not whatever is mounted over it
+static vnode* lookup_entry(vnode* dir, const char* name, size_t len) {
+    if (is_dot(name, len) || !dir->ops->lookup) return nullptr;
+    return dir->ops->lookup(dir, name, len);
+}
+
+static vnode* create(const char* path, vnode_type type, mode_t mode) {
+    const char* name;
+    size_t len;
+    vnode* dir = walk(cwd, path, &name, &len);
+    if (!dir || is_dot(name, len) || !dir->ops->create) return nullptr;
+    return dir->ops->create(dir, name, len, type, mode);
+}
+
+// Resizes t to hold at least want descriptors, in whole bitmap words
+static bool grow(fdtable* t, int want) {
+    if (want > VFS_MAX_FDS) return false;
+    int size = t->size ? t->size : VFS_INITIAL_FDS;
+    while (size < want) size *= 2;
+    if (size > VFS_MAX_FDS) size = VFS_MAX_FDS;
+
+    file** fds = (file**)mem::heap::malloc(size * sizeof(file*));
+    uint64_t* used = (uint64_t*)mem::heap::malloc(size / 64 * sizeof(uint64_t));
+    if (!fds || !used) {
+        if (fds) mem::heap::free(fds);
+        if (used) mem::heap::free(used);
+        return false;
+    }
+    mem::memset(fds, 0, size * sizeof(file*));
+    mem::memset(used, 0, size / 64 * sizeof(uint64_t));
+
+    if (t->size) {
+        mem::memcpy(fds, t->fds, t->size * sizeof(file*));
+        mem::memcpy(used, t->used, t->size / 64 * sizeof(uint64_t));
+        mem::heap::free(t->fds);
+        mem::heap::free(t->used);
+    }
+    t->fds = fds;
+    t->used = used;
+    t->size = size;
+    return true;
+}
+
+fdtable* create_fdtable() {
+    fdtable* t = (fdtable*)mem::heap::malloc(sizeof(fdtable));
+    if (!t) return nullptr;
+    mem::memset(t, 0, sizeof(fdtable));
+
+    if (!grow(t, VFS_INITIAL_FDS)) {
+        mem::heap::free(t);
+        return nullptr;
+    }
+    return t;
+}
+
+static void put_file(file* f) {
+    if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+    put(f->node);
+    mem::heap::free(f);
+}
+
+// Shares every open file of src, as fork does
+fdtable* clone_fdtable(fdtable* src) {
+    fdtable* t = create_fdtable();
+    if (!t) return nullptr;
+
+    uint64_t flags = sync::lock_irqsave(&src->lock);
+    if (!grow(t, src->size)) {
+        sync::unlock_irqrestore(&src->lock, flags);
+        destroy_fdtable(t);
+        return nullptr;
+    }
+    for (int w = 0; w < src->size / 64; w++) {
+        t->used[w] = src->used[w];
+        for (uint64_t bits = src->used[w]; bits; bits &= bits - 1) {
+            int fd = w * 64 + __builtin_ctzll(bits);
+            t->fds[fd] = src->fds[fd];
+            __atomic_add_fetch(&t->fds[fd]->refcount, 1, __ATOMIC_RELAXED);
+        }
+    }
+    t->free_hint = src->free_hint;
+    sync::unlock_irqrestore(&src->lock, flags);
+    return t;
+}
+
+void destroy_fdtable(fdtable* t) {
+    if (current_files == t) current_files = nullptr;
+    for (int w = 0; w < t->size / 64; w++) {
+        for (uint64_t bits = t->used[w]; bits; bits &= bits - 1) {
+            put_file(t->fds[w * 64 + __builtin_ctzll(bits)]);
+        }
+    }
+    mem::heap::free(t->fds);
+    mem::heap::free(t->used);
+    mem::heap::free(t);
+}
+
+void switch_fdtable(fdtable* t) {
+    current_files = t;
+}
+
+fdtable* current_fdtable() {
+    return current_files;
+}
+
+// Lowest free descriptor, found a word at a time. Caller holds t->lock.
+static int alloc_slot(fdtable* t) {
+    int words = t->size / 64;
+    for (int w = t->free_hint; w < words; w++) {
+        if (~t->used[w]) {
+            int fd = w * 64 + __builtin_ctzll(~t->used[w]);
+            t->used[w] |= 1ULL << (fd % 64);
+            t->free_hint = w;
+            return fd;
+        }
+    }
+
+    int fd = t->size;
+    if (!grow(t, fd + 1)) return -1;
+    t->used[fd / 64] |= 1ULL << (fd % 64);
+    t->free_hint = fd / 64;
+    return fd;
+}
+
+static void free_slot(fdtable* t, int fd) {
+    t->used[fd / 64] &= ~(1ULL << (fd % 64));
+    t->fds[fd] = nullptr;
+    if (fd / 64 < t->free_hint) t->free_hint = fd / 64;
+}
+
+static int install(file* f) {
+    fdtable* t = current_files;
+    if (!t) return -1;
+
+    uint64_t flags = sync::lock_irqsave(&t->lock);
+    int fd = alloc_slot(t);
+    if (fd >= 0) t->fds[fd] = f;
+    sync::unlock_irqrestore(&t->lock, flags);
+    return fd;
+}
+
+file* get_file(int fd) {
+    fdtable* t = current_files;
+    if (!t || fd < 0 || fd >= t->size) return nullptr;
+    return t->fds[fd];
+}
+
+int mount(const char* fstype, const char* target, const char* source) {
+    const filesystem* fs = nullptr;
+    for (int i = 0; i < VFS_MAX_FILESYSTEMS && filesystems[i]; i++) {
+        if (strcmp(filesystems[i]->name, fstype) == 0) {
+            fs = filesystems[i];
+            break;
+        }
+    }
+    if (!fs) {
+        Log::errf("vfs: Unknown filesystem %s", fstype);
+        return -1;
+    }
+
+    vnode* covered = nullptr;
+    if (root) {
+        covered = resolve(target);
+        if (!covered || covered->type != VNODE_DIR) {
+            Log::errf("vfs: Cannot mount %s on %s", fstype, target);
+            return -1;
+        }
+    } else if (strcmp(target, "/") != 0) {
+        Log::errf("vfs: Nothing is mounted on /");
+        return -1;
+    }
+
+    superblock* sb = fs->mount(source);
+    if (!sb) return -1;
+
+    sb->fs = fs;
+    sb->covered = covered;
+    sb->next = mounts;
+    mounts = sb;
+
+    if (covered) {
+        get(covered);
+        covered->mounted = sb;
+    } else {
+        root = cwd = sb->root;
+    }
+    return 0;
+}
+
+int chdir(const char* path) {
+    vnode* n = resolve(path);
+    if (!n || n->type != VNODE_DIR) return -1;
+    cwd = n;
+    return 0;
+}
+
+int mkdir(const char* path, mode_t mode) {
+    // Existing directories keep their children
+    if (resolve(path)) return -1;
+    return create(path, VNODE_DIR, mode) ? 0 : -1;
+}
+
+int mkdirat(int dirfd, const char* path, mode_t mode) {
+    vnode* saved = cwd;
+    file* f = get_file(dirfd);
+    if (f && f->node->type == VNODE_DIR) cwd = f->node;
+    int ret = mkdir(path, mode);
+    cwd = saved;
+    return ret;
+}
+
+int open(const char* path, int flags, mode_t mode) {
+    if (!path) return -1;
+
+    vnode* n = resolve(path);
+    if (!n && (flags & O_CREAT)) {
+        n = create(path, VNODE_FILE, mode);
+        if (!n) return -2;
+    }
+    if (!n) return -3;
+
+    file* f = (file*)mem::heap::malloc(sizeof(file));
+    if (!f) return -4;
+    f->node = n;
+    f->offset = 0;
+    f->flags = flags;
+    f->mode = mode;
+    f->refcount = 1;
+    get(n);
+
+    int fd = install(f);
+    if (fd < 0) {
+        put_file(f);
+        return -4;
+    }
+    return fd;
+}
+
+int openat(int dirfd, const char* path, int flags, mode_t mode) {
+    vnode* saved = cwd;
+    file* f = get_file(dirfd);
+    if (f && f->node->type == VNODE_DIR) cwd = f->node;
+    int fd = open(path, flags, mode);
+    cwd = saved;
+    return fd;
+}
+
+int close(int fd) {
+    fdtable* t = current_files;
+    if (!t || fd < 0 || fd >= t->size) return -1;
+
+    uint64_t flags = sync::lock_irqsave(&t->lock);
+    file* f = t->fds[fd];
+    if (f) free_slot(t, fd);
+    sync::unlock_irqrestore(&t->lock, flags);
+
+    if (!f) return -1;
+    put_file(f);
+    return 0;
+}
+
+int dup(int fd) {
+    file* f = get_file(fd);
+    if (!f) return -1;
+
+    __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+    int newfd = install(f);
+    if (newfd < 0) put_file(f);
+    return newfd;
+}
+
+int dup2(int oldfd, int newfd) {
+    fdtable* t = current_files;
+    file* f = get_file(oldfd);
+    if (!f || newfd < 0) return -1;
+    if (oldfd == newfd) return newfd;
+
+    uint64_t flags = sync::lock_irqsave(&t->lock);
+    if (newfd >= t->size && !grow(t, newfd + 1)) {
+        sync::unlock_irqrestore(&t->lock, flags);
+        return -1;
+    }
+    file* old = t->fds[newfd];
+    __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+    t->fds[newfd] = f;
+    t->used[newfd / 64] |= 1ULL << (newfd % 64);
+    sync::unlock_irqrestore(&t->lock, flags);
+
+    if (old) put_file(old);
+    return newfd;
+}
+
+static bool is_data(vnode* n) {
+    return n->type == VNODE_FILE || n->type == VNODE_CHRDEV || n->type == VNODE_BLKDEV;
+}
+
+static bool readable(vnode* n) {
+    return is_data(n) && n->ops->read;
+}
+
+static bool writable(vnode* n) {
+    return is_data(n) && n->ops->write;
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+    file* f = get_file(fd);
+    if (!f || !readable(f->node)) return -1;
+    ssize_t ret = f->node->ops->read(f->node, buf, count, f->offset);
+    if (ret > 0) f->offset += ret;
+    return ret;
+}
+
+ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
+    file* f = get_file(fd);
+    if (!f || !readable(f->node) || offset < 0) return -1;
+    return f->node->ops->read(f->node, buf, count, offset);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+    file* f = get_file(fd);
+    if (!f || !writable(f->node)) return -1;
+    ssize_t ret = f->node->ops->write(f->node, buf, count, f->offset);
+    if (ret > 0) f->offset += ret;
+    return ret;
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset) {
+    file* f = get_file(fd);
+    if (!f || !writable(f->node) || offset < 0) return -1;
+    return f->node->ops->write(f->node, buf, count, offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence) {
+    file* f = get_file(fd);
+    if (!f) return -1;
+    off_t new_offset = f->offset;
+    switch (whence) {
+        case SEEK_SET: new_offset = offset; break;
+        case SEEK_CUR: new_offset += offset; break;
+        case SEEK_END: new_offset = f->node->size + offset; break;
+        default: return -1;
+    }
+    if (new_offset < 0) return -1;
+    f->offset = new_offset;
+    return new_offset;
+}
+
+int fstat(int fd, struct stat* buf) {
+    file* f = get_file(fd);
+    if (!f) return -1;
+    vnode* n = f->node;
+
+    mode_t type = S_IFREG;
+    switch (n->type) {
+        case VNODE_DIR: type = S_IFDIR; break;
+        case VNODE_SYMLINK: type = S_IFLNK; break;
+        case VNODE_CHRDEV: type = S_IFCHR; break;
+        case VNODE_BLKDEV: type = S_IFBLK; break;
+        default: break;
+    }
+    buf->st_mode = type | n->mode;
+    buf->st_size = n->size + 1;
+    buf->st_uid = n->uid;
+    buf->st_gid = n->gid;
+    return 0;
+}
+
+int fchmod(int fd, mode_t mode) {
+    file* f = get_file(fd);
+    if (!f) return -1;
+    f->node->mode = mode;
+    return 0;
+}
+
+int fchown(int fd, uid_t owner, gid_t group) {
+    file* f = get_file(fd);
+    if (!f) return -1;
+    f->node->uid = owner;
+    f->node->gid = group;
+    return 0;
+}
+
+int ftruncate(int fd, off_t length) {
+    file* f = get_file(fd);
+    if (!f || f->node->type != VNODE_FILE || !f->node->ops->truncate || length < 0) return -1;
+    if (f->node->ops->truncate(f->node, length) < 0) return -1;
+    if (f->offset > length) f->offset = length;
+    return 0;
+}
+
+int fsync(int fd) { return 0; }
+int fdatasync(int fd) { return 0; }
+
+int link(const char* oldpath, const char* newpath) {
+    vnode* n = resolve(oldpath);
+    if (!n || n->type == VNODE_DIR) return -1;
+    if (resolve(newpath)) return -1;
+
+    const char* name;
+    size_t len;
+    vnode* dir = walk(cwd, newpath, &name, &len);
+    if (!dir || is_dot(name, len) || dir->sb != n->sb || !dir->ops->link) return -1;
+    return dir->ops->link(dir, name, len, n);
+}
+
+static int remove(const char* path, bool want_dir) {
+    const char* name;
+    size_t len;
+    vnode* dir = walk(cwd, path, &name, &len);
+    if (!dir) return -1;
+
+    vnode* n = lookup_entry(dir, name, len);
+    if (!n || n->mounted || (n->type == VNODE_DIR) != want_dir) return -1;
+    if (!dir->ops->unlink || dir->ops->unlink(dir, n) < 0) return -1;
+
+    if (cwd == n) cwd = dir;
+    put(n);
+    return 0;
+}
+
+int unlink(const char* path) {
+    return remove(path, false);
+}
+
+int rmdir(const char* path) {
+    return remove(path, true);
+}
+
+int rename(const char* oldpath, const char* newpath) {
+    const char* oname;
+    const char* nname;
+    size_t olen, nlen;
+    vnode* odir = walk(cwd, oldpath, &oname, &olen);
+    vnode* ndir = walk(cwd, newpath, &nname, &nlen);
+    if (!odir || !ndir || is_dot(nname, nlen)) return -1;
+
+    vnode* n = lookup_entry(odir, oname, olen);
+    if (!n || n->mounted || n->sb != ndir->sb || !n->ops->rename) return -1;
+
+    vnode* old = lookup_entry(ndir, nname, nlen);
+    if (old && old != n) {
+        if (old->type == VNODE_DIR || old->mounted) return -1;
+        if (!ndir->ops->unlink || ndir->ops->unlink(ndir, old) < 0) return -1;
+        put(old);
+    }
+
+    return n->ops->rename(n, ndir, nname, nlen);
+}
+
+int symlink(const char* target, const char* linkpath) {
+    if (!resolve(target)) return -1;
+    if (resolve(linkpath)) return -1;
+
+    const char* name;
+    size_t len;
+    vnode* dir = walk(cwd, linkpath, &name, &len);
+    if (!dir || is_dot(name, len) || !dir->ops->symlink) return -1;
+    return dir->ops->symlink(dir, name, len, target);
+}
+
+ssize_t readlink(const char* path, char* buf, size_t bufsize) {
+    vnode* n = resolve(path);
+    if (!n || n->type != VNODE_SYMLINK || !n->ops->readlink) return -1;
+    return n->ops->readlink(n, buf, bufsize);
+}
+
+ssize_t getdents(int fd, void* buf, size_t bufsize) {
+    file* f = get_file(fd);
+    if (!f || f->node->type != VNODE_DIR || !f->node->ops->getdents) return -1;
+    return f->node->ops->getdents(f->node, buf, bufsize);
+}
+
+}
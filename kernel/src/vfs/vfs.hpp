@@ -0,0 +1,197 @@
+#ifndef VFS_HPP
+#define VFS_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+#include <types.hpp>
+#include <sync/spinlock.hpp>
+#include "pages.hpp"
+
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+#define O_RDONLY 0x0000
+#define O_WRONLY 0x0001
+#define O_RDWR 0x0002
+#define O_CREAT 0x0040
+#define O_EXCL 0x0080
+#define O_TRUNC 0x0200
+#define O_APPEND 0x0400
+#define O_DIRECTORY 0x10000
+#define O_CLOEXEC 0x80000
+
+#define S_IRUSR 0x0100
+#define S_IWUSR 0x0080
+#define S_IXUSR 0x0040
+#define S_IRGRP 0x0020
+#define S_IWGRP 0x0010
+#define S_IXGRP 0x0008
+#define S_IROTH 0x0004
+#define S_IWOTH 0x0002
+#define S_IXOTH 0x0001
+
+#define S_IFCHR 0020000
+#define S_IFDIR 0040000
+#define S_IFBLK 0060000
+#define S_IFREG 0100000
+#define S_IFLNK 0120000
+
+#define TIME_SIZE 24
+
+// Hard cap on descriptors per table, tables start at one bitmap word
+#define VFS_MAX_FDS (1 << 20)
+#define VFS_INITIAL_FDS 64
+
+struct stat {
+    uint64_t st_dev;
+    uint64_t st_ino;
+    mode_t st_mode;
+    uint32_t st_nlink;
+    uid_t st_uid;
+    gid_t st_gid;
+    uint64_t rdev;
+    off_t st_size;
+    uint64_t st_blksize;
+    uint64_t st_blocks;
+    uint8_t st_atime[TIME_SIZE];
+    uint8_t st_mtime[TIME_SIZE];
+    uint8_t st_ctime[TIME_SIZE];
+    uint32_t st_result_mask;
+    uint32_t st_attributes;
+    uint64_t st_change_cookie;
+};
+
+namespace vfs {
+
+enum vnode_type : uint8_t {
+    VNODE_FILE,
+    VNODE_DIR,
+    VNODE_SYMLINK,
+    VNODE_CHRDEV,
+    VNODE_BLKDEV,
+};
+
+struct vnode;
+struct superblock;
+
+// Operations a filesystem provides for its nodes. Any entry may be null,
+// the call then fails with -1. Names passed in are not NUL terminated.
+struct vnode_ops {
+    vnode* (*lookup)(vnode* dir, const char* name, size_t len);
+    vnode* (*create)(vnode* dir, const char* name, size_t len, vnode_type type, mode_t mode);
+    int (*link)(vnode* dir, const char* name, size_t len, vnode* target);
+    int (*symlink)(vnode* dir, const char* name, size_t len, const char* target);
+    // Drops the entry from its directory, the VFS puts the entry's reference
+    int (*unlink)(vnode* dir, vnode* node);
+    int (*rename)(vnode* node, vnode* new_dir, const char* name, size_t len);
+    ssize_t (*getdents)(vnode* dir, void* buf, size_t bufsize);
+
+    ssize_t (*read)(vnode* node, void* buf, size_t count, off_t offset);
+    ssize_t (*write)(vnode* node, const void* buf, size_t count, off_t offset);
+    int (*truncate)(vnode* node, off_t length);
+    // Page cache backing store, page is one whole page to fill or write out
+    int (*readpage)(vnode* node, uint64_t index, void* page);
+    int (*writepage)(vnode* node, uint64_t index, const void* page);
+    ssize_t (*readlink)(vnode* node, char* buf, size_t bufsize);
+
+    // Last reference is gone
+    void (*release)(vnode* node);
+};
+
+// Embedded as the first member of each filesystem's own node struct
+struct vnode {
+    const vnode_ops* ops;
+    superblock* sb;
+    vnode_type type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    size_t size;
+    int refcount;           // one for the directory entry, one per open file
+    superblock* mounted;    // filesystem mounted over this directory
+    page_tree pages;        // cached file data, see pagecache.hpp
+};
+
+struct filesystem {
+    const char* name;
+    superblock* (*mount)(const char* source);
+};
+
+struct superblock {
+    const filesystem* fs;
+    vnode* root;
+    vnode* covered;         // directory this is mounted on, null for /
+    void* data;
+    superblock* next;
+};
+
+// An open file, shared by every descriptor dup'd or inherited from it
+struct file {
+    vnode* node;
+    off_t offset;
+    int flags;
+    mode_t mode;
+    int refcount;
+};
+
+// Per-process descriptor table. Bit n of used is set while fds[n] is
+// taken, words below free_hint are known to be full.
+struct fdtable {
+    file** fds;
+    uint64_t* used;
+    int size;
+    int free_hint;
+    sync::spinlock lock;
+};
+
+void initialise();
+
+int register_filesystem(const filesystem* fs);
+int mount(const char* fstype, const char* target, const char* source = nullptr);
+
+fdtable* create_fdtable();
+fdtable* clone_fdtable(fdtable* src);
+void destroy_fdtable(fdtable* t);
+void switch_fdtable(fdtable* t);
+fdtable* current_fdtable();
+// Open file behind fd in the current table, no reference is taken
+file* get_file(int fd);
+
+vnode* resolve(const char* path);
+void get(vnode* n);
+void put(vnode* n);
+
+int chdir(const char* path);
+int mkdir(const char* path, mode_t mode);
+int mkdirat(int dirfd, const char* path, mode_t mode);
+
+int open(const char* path, int flags, mode_t mode = 0755);
+int openat(int dirfd, const char* path, int flags, mode_t mode = 0755);
+int close(int fd);
+int dup(int fd);
+int dup2(int oldfd, int newfd);
+ssize_t read(int fd, void* buf, size_t count);
+ssize_t write(int fd, const void* buf, size_t count);
+ssize_t pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset);
+off_t lseek(int fd, off_t offset, int whence);
+int fstat(int fd, struct stat* buf);
+int fchmod(int fd, mode_t mode);
+int fchown(int fd, uid_t owner, gid_t group);
+int ftruncate(int fd, off_t length);
+int fsync(int fd);
+int fdatasync(int fd);
+
+int link(const char* oldpath, const char* newpath);
+int unlink(const char* path);
+int rename(const char* oldpath, const char* newpath);
+int symlink(const char* target, const char* linkpath);
+ssize_t readlink(const char* path, char* buf, size_t bufsize);
+
+int rmdir(const char* path);
+ssize_t getdents(int fd, void* buf, size_t bufsize);
+
+}
+
+#endif /* VFS_HPP */
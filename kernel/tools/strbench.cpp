@@ -0,0 +1,178 @@
+// Host-side check and benchmark for the kernel's libcxx/cstring.cpp.
+// Build and run with `make strbench` from the top-level directory.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Stand-ins for the kernel headers cstring.cpp pulls in
+#define MEM_HPP 1
+#define CSTRING 1
+namespace mem {
+    void* memset(void* d, int v, size_t n) { return ::memset(d, v, n); }
+    void* memcpy(void* d, const void* s, size_t n) { return ::memcpy(d, s, n); }
+    int memcmp(const void* a, const void* b, size_t n) { return ::memcmp(a, b, n); }
+    namespace heap { void* malloc(size_t n) { return ::malloc(n); } }
+}
+
+namespace kstr {
+#include "../src/libcxx/cstring.cpp"
+}
+
+// The byte loops cstring.cpp used before, as the baseline
+namespace naive {
+
+unsigned int strlen(const char* str) {
+    unsigned int len = 0;
+    while (str[len]) len++;
+    return len;
+}
+
+int strcmp(const char* s1, const char* s2) {
+    while (*s1 && (*s1 == *s2)) {
+        s1++;
+        s2++;
+    }
+    return (unsigned char)*s1 - (unsigned char)*s2;
+}
+
+char* strncpy(char* dest, const char* src, unsigned int n) {
+    unsigned int i = 0;
+    while (i < n && src[i]) {
+        dest[i] = src[i];
+        i++;
+    }
+    while (i < n) dest[i++] = '\0';
+    return dest;
+}
+
+char* strchr(const char* str, int c) {
+    while (*str) {
+        if (*str == (char)c) return (char*)str;
+        str++;
+    }
+    return nullptr;
+}
+
+char* strstr(const char* haystack, const char* needle) {
+    if (!*needle) return (char*)haystack;
+    while (*haystack) {
+        const char* h = haystack;
+        const char* n = needle;
+        while (*h && *n && (*h == *n)) {
+            h++;
+            n++;
+        }
+        if (!*n) return (char*)haystack;
+        haystack++;
+    }
+    return nullptr;
+}
+
+}
+
+static const char* components[] = {
+    "bin", "boot", "dev", "etc", "home", "lib", "lib64", "mnt", "opt", "proc",
+    "root", "run", "sbin", "srv", "sys", "tmp", "usr", "var", "share", "include",
+    "local", "libexec", "terminfo", "x86_64-linux-gnu", "python3.12", "site-packages",
+    "ld-linux-x86-64.so.2", "libc.so.6", "libstdc++.so.6.0.33", "README.md",
+    "initproc", "sysheaders", "syscode", "fonts", "locale", "zoneinfo",
+};
+#define NCOMP (sizeof(components) / sizeof(components[0]))
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } \
+} while (0)
+
+static int sign(int v) { return (v > 0) - (v < 0); }
+
+// Random strings at every alignment, against the host libc
+static void check() {
+    static char a[512], b[512], d1[600], d2[600];
+    for (int it = 0; it < 200000; it++) {
+        size_t oa = rand() % 16, ob = rand() % 16, len = rand() % 300;
+        for (size_t i = 0; i < len; i++) a[oa + i] = 'a' + rand() % 3;
+        a[oa + len] = 0;
+        memcpy(b + ob, a + oa, len + 1);
+        if (len && rand() % 2) b[ob + rand() % len] = 'a' + rand() % 4;
+        if (rand() % 4 == 0) b[ob + rand() % (len + 1)] = 0;
+
+        CHECK(kstr::strlen(a + oa) == strlen(a + oa));
+        CHECK(sign(kstr::strcmp(a + oa, b + ob)) == sign(strcmp(a + oa, b + ob)));
+
+        int c = 'a' + rand() % 4;
+        char* want = c ? strchr(a + oa, c) : nullptr;
+        CHECK(kstr::strchr(a + oa, c) == want);
+
+        size_t nl = rand() % 8;
+        char needle[16];
+        for (size_t i = 0; i < nl; i++) needle[i] = 'a' + rand() % 2;
+        needle[nl] = 0;
+        CHECK(kstr::strstr(a + oa, needle) == strstr(a + oa, needle));
+        if (len > 4) {
+            size_t at = rand() % (len - 4);
+            CHECK(kstr::strstr(a + oa, b + ob + at) == strstr(a + oa, b + ob + at));
+        }
+
+        unsigned n = rand() % 320;
+        memset(d1, 0x55, sizeof(d1));
+        memset(d2, 0x55, sizeof(d2));
+        kstr::strncpy(d1 + ob, a + oa, n);
+        strncpy(d2 + ob, a + oa, n);
+        CHECK(memcmp(d1, d2, sizeof(d1)) == 0);
+    }
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Printed at the end so the compiler cannot drop the work
+static uint64_t sink;
+
+#define BENCH(name, iters, expr) do { \
+    double t0 = now(); \
+    for (int r = 0; r < (iters); r++) { namespace S = naive; expr; } \
+    double t1 = now(); \
+    for (int r = 0; r < (iters); r++) { namespace S = kstr; expr; } \
+    double t2 = now(); \
+    printf("%-8s naive %8.2f ms  word %8.2f ms  x%.2f\n", name, \
+           (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t1 - t0) / (t2 - t1)); \
+} while (0)
+
+int main() {
+    check();
+    printf(failures ? "FAILED (%d failures)\n" : "PASSED (%d failures)\n", failures);
+    if (failures) return 1;
+
+    // Absolute paths built from the components, like the ones tmpfs resolves
+    enum { NPATHS = 4096 };
+    static char paths[NPATHS][256];
+    for (int i = 0; i < NPATHS; i++) {
+        char* p = paths[i];
+        int depth = 2 + rand() % 6;
+        for (int d = 0; d < depth; d++) p += sprintf(p, "/%s", components[rand() % NCOMP]);
+    }
+    // One directory's children, as seen by the sibling walk in tmpfs lookup
+    static char siblings[NCOMP][64];
+    for (size_t i = 0; i < NCOMP; i++) strcpy(siblings[i], components[i]);
+
+    static char copies[NPATHS][256];
+    for (int i = 0; i < NPATHS; i++) strcpy(copies[i], paths[i]);
+
+    static char dst[256];
+    BENCH("strlen", 2000, for (int i = 0; i < NPATHS; i++) sink += S::strlen(paths[i]));
+    BENCH("strcmp", 200, for (int i = 0; i < NPATHS; i++) for (size_t s = 0; s < NCOMP; s++)
+                             sink += S::strcmp(siblings[s], components[i % NCOMP]) == 0);
+    BENCH("strcmp=", 2000, for (int i = 0; i < NPATHS; i++) sink += S::strcmp(paths[i], copies[i]));
+    BENCH("strchr", 2000, for (int i = 0; i < NPATHS; i++) sink += (uintptr_t)S::strchr(paths[i] + 1, '/'));
+    BENCH("strncpy", 2000, for (int i = 0; i < NPATHS; i++) sink += (uintptr_t)S::strncpy(dst, paths[i], sizeof(dst)));
+    BENCH("strstr", 500, for (int i = 0; i < NPATHS; i++) sink += (uintptr_t)S::strstr(paths[i], "site-packages"));
+    printf("(%llu)\n", (unsigned long long)sink);
+    return 0;
+}